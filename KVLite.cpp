@@ -6,14 +6,73 @@
 /* The syntax is simple
  * kvlite accepts the following GET requests:
  * /get/[key]
+ * /mget/?k=[key]&k=[key]...
  * /set/[key]?v=[value]
+ * /set/[key]?offset=[n]&v=[bytes]
+ * /set/[key]?append=1&v=[bytes]
  * /edit/[key]
+ * /delete/[key]
+ * /snapshot
+ * /stats
+ * /debug/slowlog?n=[count]
+ *
+ * Values are stored lz4 compressed when that pays off.  Clients that
+ * send "Accept-Encoding: lz4" get the compressed bytes as stored, with
+ * "Content-Encoding: lz4": a single LZ4 block in the plain block format,
+ * without a frame header, checksum or length prefix.  The decoded size
+ * a block decoder needs is sent as "X-Decoded-Length: [bytes]".  Value
+ * responses carry "Vary: Accept-Encoding" for caches in between.
+ * /get/ sends an ETag computed when the value was written, and answers
+ * a matching If-None-Match with 304 without reading the value.  A
+ * single "Range: bytes=" range is answered with 206 and just that part
+ * of the value.  /set/ with offset= or append= writes only the given
+ * bytes into an existing value.  A value changed that way is stored
+ * uncompressed from then on, so that later partial writes touch only
+ * the bytes they change; a full /set/ compresses it again.
+ *
+ * Connections are watched by the main thread and handed to a pool of
+ * worker threads as requests arrive.  /get/, /mget/, /set/ and /delete/
+ * honour keep-alive; other requests close the connection.  Under
+ * overload requests are answered with a fast 503 and Retry-After.  A
+ * client may send "X-Deadline-Ms: [ms]" to have its request dropped
+ * rather than served once it has waited that long.
+ *
+ * Tracing: with --trace each worker keeps the phase timings of its
+ * recent requests, and /debug/slowlog lists the slowest by path, with
+ * the query string left out.  Where <sys/sdt.h> is available the phase boundaries
+ * are also USDT probes (provider kvlite) for perf or bpftrace.
+ *
+ * A store can also be dumped and loaded offline:
+ * kvlite --dump [store] > dump
+ * kvlite --load [store] < dump
+ *
+ * Replication: a server started with --primary keeps a sequenced change
+ * log of every set and delete and serves it from /log/?from=[seq].  A
+ * server started with --replica-of host:port tails that log, applies
+ * it to its own store and serves gets.  A replica that is too far
+ * behind the log reloads from the primary's /snapshot.
+ *
+ * Write buffering: with --memtable [mb] sets and deletes are logged to
+ * the change log and kept in memory, where repeated writes to a key
+ * replace each other, and are written to the store in sorted batches.
+ * Writes on a full memtable wait for a flush.  Anything not yet
+ * written when the server stops is replayed from the log at startup.
+ *
+ * Fast restart: the server keeps a sketch of the keys it reads most and
+ * saves the hottest to STORE/hotkeys every minute.  At startup those
+ * values are read back into the page cache in the background while
+ * requests are served; /stats shows the startup time and progress.
+ *
+ * Proxy: kvlite --proxy port host:port... serves the same requests by
+ * routing each key to one of the given kvlite backends over pooled
+ * keep-alive connections.
  */
 
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -23,8 +82,23 @@
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <math.h>
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
 
 #include "md5.h"
+#include "lz.h"
 
 #define ISspace(x) isspace((int)(x))
 
@@ -36,6 +110,397 @@ char * STORE = NULL;
 
 const unsigned int BUFFER_SIZE = 16384;
 
+/* Values that were overwritten while a snapshot is being streamed are
+ * hard linked here so the snapshot still sees the old version. */
+const char * SNAPSHOT_DIR = "snapshot/";
+pid_t snapshot_pid = 0;
+
+/* Dumps are a magic string and the change log sequence number the dump
+ * is consistent with, followed by blocks of sorted records.  Each
+ * block is a 12 byte header (raw length, stored length, crc32 of the
+ * raw bytes) and the stored bytes, which are lz compressed unless the
+ * stored length equals the raw length.  A zero raw length ends the
+ * dump.  Records are a 32 byte hash, a 4 byte length and the value
+ * file's bytes. */
+const char * DUMP_MAGIC = "KVLDUMP2";
+const unsigned int DUMP_BLOCK_SIZE = 262144;
+
+/* Value files begin with a 24 byte header: the magic, the codec, three
+ * reserved bytes, the raw length, the stored length and a 64 bit hash
+ * used as the ETag: of the raw value when written whole, or of the
+ * previous ETag and the change after a partial write.  Files with the older 16 byte
+ * "KVL1" header have no ETag, and files without any magic hold a raw
+ * value written by an older kvlite still. */
+const char * VALUE_MAGIC = "KVL2";
+const unsigned int VALUE_HEADER_SIZE = 24;
+const char * VALUE_MAGIC_V1 = "KVL1";
+const unsigned int VALUE_HEADER_SIZE_V1 = 16;
+#define CODEC_RAW 0
+#define CODEC_LZ4 1
+
+/* Values shorter than this, or that shrink by less than an eighth,
+ * are stored raw. */
+int COMPRESS = 1;
+const unsigned int COMPRESS_MIN = 64;
+
+struct value_info {
+    int codec;
+    unsigned int raw_len;
+    unsigned int stored_len;
+    unsigned int offset;
+    int has_etag;
+    unsigned long long etag;
+};
+
+struct request_headers {
+    int accept_lz4;
+    char if_none_match[256];
+    char range[256];
+};
+
+/* A value being read, either from its file or from a copy of its
+ * memtable entry. */
+struct value_source {
+    int fd;
+    unsigned char * mem;
+    unsigned int mem_len;
+    struct value_info info;
+};
+
+/* Whether the connection this thread is serving stays open after the
+ * current response.  Responses send the matching Connection header. */
+__thread int keep_alive = 0;
+const int KEEP_ALIVE_TIMEOUT = 30;
+const int REQUEST_TIMEOUT = 5;
+
+/* Admission control.  Each worker has a bounded queue of connections
+ * with a request waiting.  Requests are shed when every queue is full,
+ * when there are more than MAX_CONNECTIONS connections, when their
+ * deadline has passed, or when the time spent queued has stayed above
+ * CODEL_TARGET_NS for a whole CODEL_INTERVAL_NS (CoDel). */
+int WORKERS = 8;
+int MAX_CONNECTIONS = 1024;
+#define QUEUE_DEPTH 64
+const unsigned long long CODEL_TARGET_NS = 5000000ULL;
+const unsigned long long CODEL_INTERVAL_NS = 100000000ULL;
+
+struct queued_conn {
+    int fd;
+    unsigned long long ready_ns;
+};
+
+/* Request tracing.  The time between phase boundaries is added to the
+ * phase that just ended; anything unaccounted for is reported as
+ * "other".  Each worker keeps its last TRACE_RING requests. */
+enum trace_phase { PHASE_QUEUE, PHASE_PARSE, PHASE_HASH, PHASE_IO,
+                   PHASE_CODEC, PHASE_SEND, PHASE_COUNT };
+const char * PHASE_NAMES[PHASE_COUNT] = { "queue", "parse", "hash", "io",
+                                          "codec", "send" };
+#define TRACE_RING 256
+#define TRACE_URL_SIZE 64
+int TRACE = 0;
+
+struct trace_record {
+    unsigned long long start_ns;
+    unsigned long long total_ns;
+    unsigned long long phase_ns[PHASE_COUNT];
+    char url[TRACE_URL_SIZE];
+    int active;
+};
+
+struct trace_ring {
+    pthread_mutex_t lock;
+    struct trace_record records[TRACE_RING];
+    unsigned int next;
+};
+
+__thread struct trace_record trace_current;
+__thread unsigned long long trace_mark_ns;
+
+/* kvlite:phase fires at each boundary with the phase that ended */
+#ifdef HAVE_SDT
+#define TRACE_PROBE(p) DTRACE_PROBE1(kvlite, phase, (int)(p))
+#else
+#define TRACE_PROBE(p) do { } while (0)
+#endif
+#define TRACE_PHASE(p) do { TRACE_PROBE(p); \
+                            if ( TRACE ) trace_phase(p); } while (0)
+
+/* Hot key profile.  Each worker counts one in HOT_SAMPLE of the values
+ * it reads in a Space-Saving sketch of HOT_SKETCH_SIZE keys; the merged
+ * top HOT_PROFILE_SIZE are saved every HOT_SAVE_SECONDS and prefetched
+ * by WARMUP_THREADS threads at the next startup.  --hot-sample 0 turns
+ * the profile and the warm-up off. */
+#define HOT_SKETCH_SIZE 256
+#define HOT_PROFILE_SIZE 1024
+const int HOT_SAVE_SECONDS = 60;
+const int WARMUP_THREADS = 4;
+const char * HOT_PROFILE = "hotkeys";
+int HOT_SAMPLE = 16;
+
+struct hot_entry {
+    char hash[33];
+    unsigned long count;
+};
+
+struct hot_sketch {
+    pthread_mutex_t lock;
+    struct hot_entry entries[HOT_SKETCH_SIZE];
+    int used;
+};
+
+__thread struct hot_sketch * hot_local = NULL;
+__thread int hot_skipped = 0;
+
+struct warmup_status {
+    char (* hashes)[33];
+    unsigned long total;
+    unsigned long claimed;
+    unsigned long done;
+    unsigned long bytes;
+    int running;
+    unsigned long long started_ns;
+    unsigned long long finished_ns;
+} warmup;
+
+unsigned long long process_start_ns = 0;
+unsigned long long listening_ns = 0;
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct queued_conn queue[QUEUE_DEPTH];
+    int head;
+    int count;
+    struct trace_ring trace;
+    struct hot_sketch hot;
+};
+
+struct worker * workers = NULL;
+int wake_pipe[2];
+int open_connections = 0;
+
+struct codel_state {
+    unsigned long long first_above;
+    unsigned long long drop_next;
+    unsigned long long last_dequeue;
+    unsigned int count;
+    int dropping;
+} codel;
+
+struct admission_stats {
+    unsigned long rejected;
+    unsigned long shed;
+    unsigned long expired;
+    unsigned long timed_out;
+    unsigned long dequeued;
+    unsigned long long sojourn_ns;
+} admission;
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* When the request being served became readable, and whether CoDel
+ * chose to drop it. */
+__thread unsigned long long request_ready_ns = 0;
+__thread int request_shed = 0;
+
+/* When a worker stops waiting for the rest of a request head.  The
+ * socket timeout restarts with every byte, so a client trickling its
+ * headers would otherwise hold the worker indefinitely.  Zero on
+ * threads that are not serving clients. */
+__thread unsigned long long request_deadline_ns = 0;
+
+/* The change log is a 16 byte header (magic and the sequence number of
+ * its first record) followed by records of: 8 byte sequence number,
+ * 8 byte time in ms, 1 byte op, 32 byte hash, 4 byte length, the value
+ * file's bytes and a crc32 of everything before it.  A patch carries
+ * an 8 byte offset into the value followed by the bytes written there.  The same records
+ * are streamed to replicas, with heartbeats mixed in when idle. */
+const char * LOG_NAME = "changelog";
+const char * LOG_MAGIC = "KVLLOG1\n";
+const unsigned int LOG_HEADER_SIZE = 16;
+const unsigned int LOG_RECORD_OVERHEAD = 57;
+const unsigned long LOG_MAX_SIZE = 64 * 1024 * 1024;
+#define LOG_SET 'S'
+#define LOG_PATCH 'P'
+#define LOG_DELETE 'D'
+#define LOG_HEARTBEAT 'H'
+
+struct log_record {
+    unsigned long long seq;
+    unsigned long long time;
+    char op;
+    char hash[33];
+    const unsigned char * data;
+    unsigned int len;
+};
+
+/* Buffered reader for a stream of change log records. */
+struct log_reader {
+    int fd;
+    unsigned char * buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    unsigned long consumed;
+};
+
+int PRIMARY = 0;
+int log_fd = -1;
+unsigned long long log_base = 1;
+unsigned long long log_seq = 0;
+unsigned long log_end = 0;
+unsigned long log_generation = 0;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_appended = PTHREAD_COND_INITIALIZER;
+
+/* Serialises changes to value files with snapshots and the log. */
+pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writers of the same value are serialised by one of KEY_LOCKS locks,
+ * picked by the value's hash and held for the whole change, so that a
+ * partial write's read, change and write cannot interleave with a set.
+ * Taken before store_lock. */
+#define KEY_LOCKS 256
+pthread_mutex_t key_locks[KEY_LOCKS];
+
+/* Write-behind memtable.  Writes go to the active table; a flush swaps
+ * it with the empty flushing table and writes the flushing table out
+ * while new writes fill the active one.  Reads look in the active
+ * table, then the flushing table, then the store.  Buckets are chosen
+ * by the first four hex digits of the hash and their chains are kept
+ * sorted, so walking the buckets visits keys in hash order.  Every
+ * change is in the change log before it is acknowledged; memtable.state
+ * holds the sequence number of the last change known to be in the
+ * store, and the log is not rotated while changes after it are only in
+ * memory. */
+#define MEMTABLE_BUCKETS 65536
+#define MEM_MISS 0
+#define MEM_HIT 1
+#define MEM_DELETED 2
+#define MEM_ERROR 3
+int MEMTABLE = 0;
+size_t MEMTABLE_MAX = 64 * 1024 * 1024;
+const int MEMTABLE_FLUSH_MS = 1000;
+const char * MEMTABLE_STATE = "memtable.state";
+
+struct mem_entry {
+    char hash[33];
+    int deleted;
+    unsigned char * data;
+    unsigned int len;
+    struct mem_entry * next;
+};
+
+struct mem_table {
+    struct mem_entry * buckets[MEMTABLE_BUCKETS];
+    unsigned long count;
+    size_t bytes;
+};
+
+struct mem_table * memtable_active = NULL;
+struct mem_table * memtable_flushing = NULL;
+/* the log sequence number the flushing table holds changes up to */
+unsigned long long memtable_flushing_seq = 0;
+
+struct memtable_stats {
+    unsigned long writes;
+    unsigned long coalesced;
+    unsigned long flushes;
+    unsigned long flushed;
+    unsigned long stalls;
+    unsigned long flush_errors;
+} memtable;
+
+/* flush_lock is held for a whole flush and taken before store_lock;
+ * memtable_lock guards the tables and is taken last. */
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t memtable_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t memtable_full = PTHREAD_COND_INITIALIZER;
+pthread_cond_t memtable_drained = PTHREAD_COND_INITIALIZER;
+
+char * REPLICA_HOST = NULL;
+u_short REPLICA_PORT = 0;
+const char * REPLICA_STATE = "replica.state";
+const char * RESYNC_DIR = "resync/";
+
+/* The primary sends a heartbeat every second; a replica that hears
+ * nothing for this many seconds treats the primary as gone. */
+const int REPLICA_TIMEOUT = 5;
+
+/* A record that cannot be applied is retried from a new connection;
+ * after this many failures in a row the replica reloads a snapshot. */
+const int REPLICA_RETRIES = 3;
+
+struct replica_status {
+    unsigned long long applied;
+    unsigned long long applied_time;
+    unsigned long long primary_seq;
+    unsigned long long last_contact;
+    int connected;
+    unsigned long apply_errors;
+    unsigned long long failed_seq;
+    int failures;
+} replica;
+pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Proxy mode.  Keys are placed on a ring of md5 points, PROXY_VNODES per
+ * backend, and belong to the first backend point at or after them. */
+#define PROXY_VNODES 160
+#define PROXY_POOL_SIZE 32
+
+struct backend_conn {
+    int fd;
+    int reused;
+    size_t start;
+    size_t end;
+    char buf[BUFFER_SIZE];
+};
+
+struct backend {
+    char * host;
+    u_short port;
+    pthread_mutex_t lock;
+    struct backend_conn * idle[PROXY_POOL_SIZE];
+    int idle_count;
+    unsigned long requests;
+};
+
+struct backend_response {
+    int status;
+    long content_length;
+    int keep_alive;
+    char status_line[256];
+    char headers[BUFFER_SIZE];
+    size_t headers_len;
+};
+
+/* One backend's share of a proxied /mget/. */
+struct mget_part {
+    char * url;
+    size_t url_len;
+    struct backend_conn * conn;
+    int sent;
+    char * body;
+    size_t body_len;
+    size_t offset;
+};
+
+struct ring_point {
+    unsigned int point;
+    int backend;
+};
+
+int PROXY = 0;
+struct backend * backends = NULL;
+int backend_count = 0;
+struct ring_point * ring = NULL;
+int ring_size = 0;
+unsigned long proxy_requests = 0;
+unsigned long long proxy_overhead_ns = 0;
+pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread unsigned long long backend_wait_ns = 0;
+
 u_short PORT = 4444;
 
 //#define ENABLE_LOGGING
@@ -43,17 +508,186 @@ u_short PORT = 4444;
 const char * LOG_FILE = "/tmp/kvlite.log";
 #endif
 
-void get(int client, char * key);
+void get(int client, char * key, struct request_headers * request);
+void mget(int client, char * query);
 void set(int client, char * key, char * value);
+void set_part(int client, char * key, char * value,
+              unsigned long long offset, int append);
 void edit(int client, char * key);
-void accept_request(int);
+void del(int client, char * key);
+void snapshot(int client);
+void stats(int client);
+int snapshot_running();
+void * snapshot_reaper(void * arg);
+void close_inherited(int keep);
+void preserve(const char * hash);
+long dump_store(int fd, const char * store, const char * preserved,
+                struct mem_table * overlay, unsigned long long seq);
+long add_hash(char (** hashes)[33], long count, long * size, const char * hash);
+long load_store(int fd, const char * store, unsigned long long * seq);
+int write_value_file(const char * store, const char * hash,
+                     const unsigned char * data, size_t len);
+int write_temp_file(const char * tmp, const unsigned char * data, size_t len);
+int store_value(const char * hash, const unsigned char * data, size_t len);
+int replace_value(const char * hash, const unsigned char * data, size_t len);
+int remove_value(const char * hash);
+pthread_mutex_t * key_lock(const char * hash);
+int patch_value(const char * hash, unsigned long long offset, int append,
+                const unsigned char * data, size_t len);
+int patch_raw(const char * hash, unsigned long long offset, int append,
+              const unsigned char * data, size_t len);
+int patch_append(int fd, const char * hash, struct value_info * info,
+                 const unsigned char * data, size_t len);
+int patch_copy(int fd, const char * hash, struct value_info * info,
+               unsigned long long offset, const unsigned char * data, size_t len);
+int patch_rewrite(const char * hash, unsigned long long offset, int append,
+                  const unsigned char * data, size_t len);
+int write_raw_header(int fd, unsigned long long len, unsigned long long etag);
+void log_patch(const char * hash, unsigned long long offset,
+               const unsigned char * data, size_t len);
+int copy_file(int in, int out, size_t len);
+int memtable_store(const char * hash, const unsigned char * data, size_t len,
+                   int deleted);
+unsigned int memtable_bucket(const char * hash);
+void memtable_put(struct mem_table * table, struct mem_entry * entry);
+struct mem_entry * memtable_find(struct mem_table * table, const char * hash);
+int memtable_get(const char * hash, unsigned char ** data, unsigned int * len);
+int memtable_info(const char * hash, struct value_info * info);
+void memtable_clear(struct mem_table * table);
+int memtable_flush(int locked);
+int memtable_write(int locked);
+void * memtable_flusher(void * arg);
+void memtable_setup();
+void memtable_recover();
+int memtable_replay(struct mem_table * table, unsigned long long last,
+                    unsigned long long * through);
+void save_memtable_state(unsigned long long seq);
+int has_values(const char * store);
+int install_values(const char * staging);
+int log_open();
+int log_scan(int fd, unsigned long long * base, unsigned long long * last,
+             unsigned long * end);
+void log_append(char op, const char * hash, const unsigned char * data,
+                unsigned int len);
+void log_rotate();
+size_t encode_log_record(unsigned char * out, char op, unsigned long long seq,
+                         unsigned long long time, const char * hash,
+                         const unsigned char * data, unsigned int len);
+long parse_log_record(const unsigned char * buf, size_t avail,
+                      struct log_record * record);
+int read_log_record(struct log_reader * reader, struct log_record * record);
+int log_record_buffered(struct log_reader * reader);
+void follow_log(int client, char * query);
+void * log_follower(void * arg);
+void * replicate(void * arg);
+int apply_log(int sock);
+int apply_record(struct log_record * record);
+int resync(int sock);
+void save_replica_state(unsigned long long seq);
+unsigned long long load_replica_state();
+unsigned long long replication_lag_ms();
+int connect_to(const char * host, u_short port);
+int http_get(const char * host, u_short port, const char * path, int * status);
+unsigned long long now_ms();
+unsigned long long now_ns();
+void proxy_setup(char ** specs, int count);
+int compare_ring_points(const void * a, const void * b);
+unsigned int hash_point(const char * text);
+int route_key(const char * key);
+struct backend_conn * pool_get(struct backend * b);
+int backend_write(struct backend_conn * conn, const char * buf, size_t len);
+void pool_put(struct backend * b, struct backend_conn * conn);
+void pool_discard(struct backend_conn * conn);
+long conn_fill(struct backend_conn * conn);
+int conn_read_line(struct backend_conn * conn, char * line, int size);
+long conn_read(struct backend_conn * conn, char * buf, size_t len);
+int read_response_head(struct backend_conn * conn, struct backend_response * response);
+int backend_exchange(struct backend * b, struct backend_conn ** conn, int sent,
+                     const char * request, size_t len,
+                     struct backend_response * response);
+size_t backend_request(char * out, struct backend * b, const char * url,
+                       const char * headers);
+int proxy_request(int client);
+void proxy_forward(int client, struct backend * b, const char * url,
+                   const char * headers);
+void proxy_mget(int client, char * query, const char * headers);
+void proxy_stats(int client);
+void put64(unsigned char * p, unsigned long long v);
+unsigned long long get64(const unsigned char * p);
+int is_hash_name(const char * name);
+void clear_dir(const char * dir);
+int write_all(int fd, const void * buf, size_t len);
+int read_all(int fd, void * buf, size_t len);
+unsigned int crc32(const unsigned char * buf, size_t len);
+unsigned long long value_etag(const unsigned char * buf, size_t len);
+unsigned long long fnv1a(unsigned long long h, const unsigned char * buf,
+                         size_t len);
+unsigned long long etag_chain(unsigned long long etag, unsigned long long offset,
+                              const unsigned char * data, size_t len);
+int parse_range(const char * range, unsigned int size,
+                unsigned int * first, unsigned int * last);
+int parse_offset(const char * text, unsigned long long * offset);
+int etag_matches(const char * if_none_match, struct value_info * info);
+void not_modified(int client, struct value_info * info, int encoded);
+int sends_lz4(struct value_info * info, struct request_headers * request);
+void put32(unsigned char * p, unsigned int v);
+unsigned int get32(const unsigned char * p);
+unsigned char * encode_value(const unsigned char * raw, unsigned int len,
+                             int compress, unsigned int * encoded_len);
+int read_value_info(int fd, struct value_info * info);
+int parse_value_info(const unsigned char * header, size_t got, size_t size,
+                     struct value_info * info);
+int open_value(const char * hash, struct value_source * src);
+ssize_t read_value_at(struct value_source * src, void * buf, size_t len,
+                      size_t offset);
+void close_value(struct value_source * src);
+unsigned char * load_value(struct value_source * src);
+int accept_request(int);
+void serve(int server_sock);
+void watch_connection(struct pollfd * fds, unsigned long long * idle_since,
+                      int * nfds, int fd, unsigned long long now);
+void dispatch_connection(int fd, unsigned long long ready_ns);
+void reject_connection(int fd);
+void release_connection(int fd, int keep);
+void * worker_main(void * arg);
+int codel_should_drop(unsigned long long sojourn, unsigned long long now);
+int codel_dropping(unsigned long long now);
+int request_expired(long deadline_ms);
+void shed_request(int client);
+int admission_report(char * buf);
+void trace_begin(unsigned long long ready_ns, unsigned long long now);
+void trace_phase(int phase);
+void trace_url(const char * url);
+void trace_end(struct trace_ring * ring);
+int compare_trace_records(const void * a, const void * b);
+void slowlog(int client, char * query);
+void hot_record(const char * hash);
+int compare_hot_hashes(const void * a, const void * b);
+int compare_hot_counts(const void * a, const void * b);
+void save_hot_profile();
+void * hot_profiler(void * arg);
+void warmup_start();
+void * warmup_worker(void * arg);
 void bad_request(int);
 void error_die(const char *);
 int get_line(int, char *, int);
+int recv_head(int sock, char * c, int flags);
+int head_timed_out(int client);
 void headers(int);
+void text_response(int client, const char * body);
+void connection_header(int client);
+void value_headers(int client, struct value_info * info, int encoded);
+void partial_headers(int client, struct value_info * info,
+                     unsigned int first, unsigned int last);
 void not_found(int);
 int startup(u_short *);
 void unimplemented(int);
+void unavailable(int);
+void forbidden(int);
+void gone(int);
+void status_page(int client, const char * status);
+void status_page_headers(int client, const char * status, const char * extra);
+void overloaded(int client);
 void urldecode(char * text);
 
 #ifdef ENABLE_LOGGING
@@ -61,20 +695,28 @@ int log(char * message);
 #endif
 
 /**********************************************************************/
-/* A request has caused a call to accept() on the server port to
- * return.  Process the request appropriately.
- * Parameters: the socket connected to the client */
+/* A request has arrived on a client connection.  Process the request
+ * appropriately.
+ * Parameters: the socket connected to the client
+ * Returns: non-zero if the connection should be kept open */
 /**********************************************************************/
-void accept_request(int client) {
+int accept_request(int client) {
     char buf[BUFFER_SIZE];
     int numchars;
     char * value;
+    char * part;
     char method[255];
     char url[BUFFER_SIZE];
+    struct request_headers request;
+    unsigned long long offset;
     size_t i, j;
+    int http11, wants_close = 0, wants_keep_alive = 0;
+    long deadline_ms = 0;
 
     /* Parse request method */
     numchars = get_line(client, buf, sizeof(buf));
+    if ( numchars == 0 )
+        return 0;
     i = 0; j = 0;
     while (!ISspace(buf[j]) && (i < sizeof(method) - 1)) {
         method[i] = buf[j];
@@ -82,144 +724,4190 @@ void accept_request(int client) {
     }
     method[i] = '\0';
 
-    /* Parse request URL */
-    i = 0;
-    while (ISspace(buf[j]) && (j < BUFFER_SIZE))
-        j++;
-    while (!ISspace(buf[j]) && (i < BUFFER_SIZE - 1) && (j < BUFFER_SIZE)) {
-        url[i] = buf[j];
-        i++; j++;
+    /* Parse request URL */
+    i = 0;
+    while (ISspace(buf[j]) && (j < BUFFER_SIZE))
+        j++;
+    while (!ISspace(buf[j]) && (i < BUFFER_SIZE - 1) && (j < BUFFER_SIZE)) {
+        url[i] = buf[j];
+        i++; j++;
+    }
+    url[i] = '\0';
+    while (ISspace(buf[j]) && (j < BUFFER_SIZE))
+        j++;
+    http11 = strncasecmp(buf + j, "HTTP/1.1", 8) == 0;
+
+    /* read headers, keeping the few we act on */
+    memset(&request, 0, sizeof(request));
+    while ((numchars > 0) && strcmp("\n", buf)) {
+        numchars = get_line(client, buf, BUFFER_SIZE);
+        if ( strncasecmp(buf, "Accept-Encoding:", 16) == 0 &&
+             strcasestr(buf + 16, "lz4") )
+            request.accept_lz4 = 1;
+        if ( strncasecmp(buf, "If-None-Match:", 14) == 0 ) {
+            strncpy(request.if_none_match, buf + 14, sizeof(request.if_none_match) - 1);
+            request.if_none_match[sizeof(request.if_none_match) - 1] = 0x00;
+        }
+        if ( strncasecmp(buf, "Range:", 6) == 0 ) {
+            strncpy(request.range, buf + 6, sizeof(request.range) - 1);
+            request.range[sizeof(request.range) - 1] = 0x00;
+        }
+        if ( strncasecmp(buf, "Connection:", 11) == 0 ) {
+            wants_close = strcasestr(buf + 11, "close") != NULL;
+            wants_keep_alive = strcasestr(buf + 11, "keep-alive") != NULL;
+        }
+        if ( strncasecmp(buf, "X-Deadline-Ms:", 14) == 0 )
+            deadline_ms = atol(buf + 14);
+    }
+    if ( strcmp("\n", buf) && head_timed_out(client) )
+        return 0;
+    TRACE_PHASE(PHASE_PARSE);
+    if ( TRACE )
+        trace_url(url);
+
+    /* only requests whose every response has a Content-Length can be
+     * followed by another request on the same connection */
+    keep_alive = http11 ? !wants_close : wants_keep_alive;
+    if ( strncasecmp(url,"/get/",5) != 0 && strncasecmp(url,"/mget/",6) != 0 &&
+         strncasecmp(url,"/set/",5) != 0 && strncasecmp(url,"/delete/",8) != 0 )
+        keep_alive = 0;
+
+    if ( ( request_shed || request_expired(deadline_ms) ) &&
+         strcasecmp(url,"/stats") != 0 &&
+         strncasecmp(url,"/debug/",7) != 0 ) {
+        shed_request(client);
+    } else if( strncasecmp(url,"/get/",5) == 0 ) {
+        get(client, url+5, &request);
+    } else if ( strncasecmp(url,"/mget/",6) == 0 ) {
+        mget(client, url+6);
+    } else if ( REPLICA_HOST && ( strncasecmp(url,"/set/",5) == 0 ||
+                                  strncasecmp(url,"/delete/",8) == 0 ) ) {
+        forbidden(client);
+    } else if ( strncasecmp(url,"/set/",5) == 0 ) {
+        value = strchr(url,'?');
+        if ( value != NULL ) {
+            value[0] = 0x00;
+            value++;
+            if ( strncmp(value, "offset=", 7) == 0 || strncmp(value, "append", 6) == 0 ) {
+                /* offset=[n]& or append=1& comes before "v=" */
+                part = value;
+                value = strchr(part, '&');
+                if ( value != NULL && strncmp(value + 1, "v=", 2) == 0 ) {
+                    value[0] = 0x00;
+                    value += 3;
+                    if ( part[0] == 'o' && parse_offset(part + 7, &offset) == 0 )
+                        set_part(client, url+5, value, offset, 0);
+                    else if ( strcmp(part, "append") == 0 || strcmp(part, "append=") == 0 ||
+                              strcmp(part, "append=1") == 0 )
+                        set_part(client, url+5, value, 0, 1);
+                    else
+                        bad_request(client);
+                } else {
+                    bad_request(client);
+                }
+            } else {
+                /* skip over "v=" */
+                value+=2;
+                set(client, url+5, value);
+            }
+        } else {
+            not_found(client);
+        }
+    } else if ( strncasecmp(url,"/edit/",6) == 0 ) {
+        edit(client, url+6);
+    } else if ( strncasecmp(url,"/delete/",8) == 0 ) {
+        del(client, url+8);
+    } else if ( strcasecmp(url,"/snapshot") == 0 ) {
+        snapshot(client);
+    } else if ( strncasecmp(url,"/log/",5) == 0 ) {
+        follow_log(client, url+5);
+    } else if ( strcasecmp(url,"/stats") == 0 ) {
+        stats(client);
+    } else if ( strncasecmp(url,"/debug/slowlog",14) == 0 ) {
+        slowlog(client, url+14);
+    } else {
+        not_found(client);
+    }
+
+    return keep_alive;
+}
+
+/**********************************************************************/
+/* Send a value to the client.  Compressed values are passed through
+ * untouched when the client accepts lz4, otherwise they are decoded.
+ * Parameters: the socket connected to the client
+ *             the key
+ *             the headers sent with the request */
+/**********************************************************************/
+void get(int client, char * key, struct request_headers * request) {
+    char buf[BUFFER_SIZE];
+    char hash[33];
+    ssize_t num_read;
+    size_t pos;
+    struct value_source src;
+    struct value_info * info = &src.info;
+    unsigned char * value;
+    unsigned int first = 0, last = 0;
+    size_t remaining;
+    int ranged = 0, found;
+    
+    md5(key,hash);
+    TRACE_PHASE(PHASE_HASH);
+    #ifdef ENABLE_LOGGING
+    sprintf(buf,"get value for %s (%s)\n",key,hash);
+    log(buf);
+    #endif
+
+    /* revalidating a value in the memtable needs only its header */
+    if ( MEMTABLE && request->if_none_match[0] &&
+         memtable_info(hash, info) == MEM_HIT &&
+         etag_matches(request->if_none_match, info) ) {
+        TRACE_PHASE(PHASE_IO);
+        hot_record(hash);
+        not_modified(client, info, sends_lz4(info, request));
+        TRACE_PHASE(PHASE_SEND);
+        return;
+    }
+    
+    if ( (found = open_value(hash, &src)) < 0 ) {
+        TRACE_PHASE(PHASE_IO);
+        if ( found == -2 )
+            unavailable(client);
+        else
+            not_found(client);
+        return;
+    }
+    TRACE_PHASE(PHASE_IO);
+    hot_record(hash);
+
+    if ( request->range[0] )
+        ranged = parse_range(request->range, info->raw_len, &first, &last);
+
+    if ( request->if_none_match[0] && etag_matches(request->if_none_match, info) ) {
+        not_modified(client, info, sends_lz4(info, request));
+        TRACE_PHASE(PHASE_SEND);
+    } else if ( ranged < 0 ) {
+        sprintf(buf, "Content-Range: bytes */%u\r\n", info->raw_len);
+        status_page_headers(client, "416 Range Not Satisfiable", buf);
+    } else if ( ranged && info->codec == CODEC_RAW ) {
+        /* read just the range from the file */
+        partial_headers(client, info, first, last);
+        TRACE_PHASE(PHASE_SEND);
+        pos = info->offset + first;
+        remaining = last - first + 1;
+        while ( remaining > 0 &&
+                (num_read = read_value_at(&src, buf, remaining < BUFFER_SIZE ?
+                                          remaining : BUFFER_SIZE, pos)) > 0 ) {
+            TRACE_PHASE(PHASE_IO);
+            send(client, buf, num_read, 0);
+            pos += num_read;
+            remaining -= num_read;
+            TRACE_PHASE(PHASE_SEND);
+        }
+    } else if ( ranged ) {
+        /* a compressed value has to be decoded to find the range */
+        if ( (value = load_value(&src)) ) {
+            partial_headers(client, info, first, last);
+            send(client, value + first, last - first + 1, 0);
+            TRACE_PHASE(PHASE_SEND);
+            free(value);
+        } else {
+            not_found(client);
+        }
+    } else if ( info->codec == CODEC_RAW || request->accept_lz4 ) {
+        value_headers(client, info, info->codec != CODEC_RAW);
+        TRACE_PHASE(PHASE_SEND);
+        pos = info->offset;
+        /* stop at stored_len: an append may be growing the file */
+        remaining = info->stored_len;
+        while ( remaining > 0 &&
+                (num_read = read_value_at(&src, buf, remaining < BUFFER_SIZE ?
+                                          remaining : BUFFER_SIZE, pos)) > 0 ) {
+            TRACE_PHASE(PHASE_IO);
+            send(client, buf, num_read, 0);
+            pos += num_read;
+            remaining -= num_read;
+            TRACE_PHASE(PHASE_SEND);
+        }
+    } else if ( (value = load_value(&src)) ) {
+        value_headers(client, info, 0);
+        send(client, value, info->raw_len, 0);
+        TRACE_PHASE(PHASE_SEND);
+        free(value);
+    } else {
+        not_found(client);
+    }
+    close_value(&src);
+}   
+
+/**********************************************************************/
+/* Send several values in one response.  For each key, in the order
+ * given, the body holds either "VALUE [key] [length]\r\n" followed by
+ * the value and "\r\n", or "MISSING [key]\r\n".
+ * Parameters: the socket connected to the client
+ *             the query string, "?k=[key]&k=[key]..." */
+/**********************************************************************/
+void mget(int client, char * query) {
+    char buf[BUFFER_SIZE];
+    char hash[33];
+    char * key;
+    char * next;
+    char * body = NULL;
+    char * grown;
+    size_t body_len = 0, body_size = 0, need;
+    struct value_source src;
+    struct value_info * info = &src.info;
+    unsigned char * value;
+    int found;
+
+    for ( key = strstr(query, "k="); key; key = next ) {
+        key += 2;
+        next = strstr(key, "&k=");
+        if ( next ) {
+            next[0] = 0x00;
+            next++;
+        }
+
+        md5(key,hash);
+        TRACE_PHASE(PHASE_HASH);
+        value = NULL;
+        found = open_value(hash, &src);
+        if ( found == 0 ) {
+            value = load_value(&src);
+            close_value(&src);
+            hot_record(hash);
+        }
+        TRACE_PHASE(PHASE_IO);
+        if ( found == -2 ) {
+            free(body);
+            unavailable(client);
+            return;
+        }
+
+        need = strlen(key) + 32 + (value ? info->raw_len : 0);
+        if ( body_len + need > body_size ) {
+            body_size = (body_len + need) * 2;
+            grown = (char *)realloc(body, body_size);
+            if ( !grown ) {
+                free(value);
+                free(body);
+                unavailable(client);
+                return;
+            }
+            body = grown;
+        }
+        if ( value ) {
+            body_len += sprintf(body + body_len, "VALUE %s %u\r\n", key, info->raw_len);
+            memcpy(body + body_len, value, info->raw_len);
+            body_len += info->raw_len;
+            body_len += sprintf(body + body_len, "\r\n");
+            free(value);
+        } else {
+            body_len += sprintf(body + body_len, "MISSING %s\r\n", key);
+        }
+    }
+
+    strcpy(buf, "HTTP/1.1 200 OK\r\n");
+    send(client, buf, strlen(buf), 0);
+    connection_header(client);
+    sprintf(buf, "Content-Type: text/plain\r\n"
+                 "Content-Length: %lu\r\n"
+                 "\r\n", (unsigned long)body_len);
+    send(client, buf, strlen(buf), 0);
+    if ( body_len )
+        send(client, body, body_len, 0);
+    TRACE_PHASE(PHASE_SEND);
+    free(body);
+}
+
+/**********************************************************************/
+
+void set(int client, char * key, char * value) {
+    char buf[BUFFER_SIZE];
+    char hash[33];
+    unsigned char * encoded;
+    unsigned int encoded_len;
+    
+    md5(key,hash);
+    TRACE_PHASE(PHASE_HASH);
+    #ifdef ENABLE_LOGGING
+    sprintf(buf,"set %s (%s) to %s\n",key,hash,value);
+    log(buf);
+    #endif
+    
+    urldecode(value);
+    encoded = encode_value((unsigned char *)value, strlen(value), COMPRESS, &encoded_len);
+    TRACE_PHASE(PHASE_CODEC);
+    if ( encoded && store_value(hash, encoded, encoded_len) == 0 ) {
+        TRACE_PHASE(PHASE_IO);
+        sprintf(buf, "set %s\n",key);
+        text_response(client, buf);
+        TRACE_PHASE(PHASE_SEND);
+    } else {
+        #ifdef ENABLE_LOGGING
+        sprintf(buf, "could not write %s%s\n",STORE,hash);
+        log(buf);
+        #endif
+        not_found(client);
+    }
+    free(encoded);
+}
+
+/**********************************************************************/
+/* Write part of a value.
+ * Parameters: the socket connected to the client
+ *             the key
+ *             the bytes to write, url encoded
+ *             where in the value to write them
+ *             non-zero to write them at the end of the value instead */
+/**********************************************************************/
+void set_part(int client, char * key, char * value,
+              unsigned long long offset, int append) {
+    char buf[BUFFER_SIZE];
+    char hash[33];
+    int result;
+
+    md5(key,hash);
+    TRACE_PHASE(PHASE_HASH);
+    #ifdef ENABLE_LOGGING
+    sprintf(buf,"set %s (%s) at %llu to %s\n",key,hash,offset,value);
+    log(buf);
+    #endif
+
+    urldecode(value);
+    result = patch_value(hash, offset, append, (unsigned char *)value, strlen(value));
+    TRACE_PHASE(PHASE_IO);
+    if ( result == 0 ) {
+        sprintf(buf, "set %s\n",key);
+        text_response(client, buf);
+        TRACE_PHASE(PHASE_SEND);
+    } else if ( result == -2 ) {
+        status_page(client, "416 Range Not Satisfiable");
+    } else {
+        not_found(client);
+    }
+}
+
+/**********************************************************************/
+
+void edit(int client, char * key) {
+    char buf[BUFFER_SIZE];
+    char hash[33];
+    struct value_source src;
+    unsigned char * value = NULL;
+    int found;
+    
+    md5(key,hash);
+    #ifdef ENABLE_LOGGING
+    sprintf(buf,"edit value for %s (%s)\n",key,hash);
+    log(buf);
+    #endif
+    
+    if ( (found = open_value(hash, &src)) == 0 ) {
+        value = load_value(&src);
+        close_value(&src);
+    }
+    if ( found == -2 ) {
+        unavailable(client);
+    } else if ( value ) {
+        headers(client);
+        sprintf(buf, "<form action=\"/set/%s\">",key);
+        send(client, buf, strlen(buf), 0);
+        sprintf(buf, "<textarea name=\"v\" rows=\"30\" cols=\"80\">");
+        send(client, buf, strlen(buf), 0);
+        send(client, value, src.info.raw_len, 0);
+        free(value);
+        sprintf(buf, "</textarea>");
+        send(client, buf, strlen(buf), 0);
+        sprintf(buf, "<input type=\"submit\" value=\"save\">");
+        send(client, buf, strlen(buf), 0);
+        sprintf(buf, "</form>");
+        send(client, buf, strlen(buf), 0);
+    } else {
+        not_found(client);
+    }
+}   
+
+/**********************************************************************/
+
+void del(int client, char * key) {
+    char buf[BUFFER_SIZE];
+    char hash[33];
+
+    md5(key,hash);
+    TRACE_PHASE(PHASE_HASH);
+    #ifdef ENABLE_LOGGING
+    sprintf(buf,"delete %s (%s)\n",key,hash);
+    log(buf);
+    #endif
+
+    if ( remove_value(hash) == 0 ) {
+        TRACE_PHASE(PHASE_IO);
+        sprintf(buf, "deleted %s\n",key);
+        text_response(client, buf);
+        TRACE_PHASE(PHASE_SEND);
+    } else {
+        not_found(client);
+    }
+}
+
+/**********************************************************************/
+/* Accept connections and watch idle ones, handing each connection to a
+ * worker once a request has arrived on it.  New connections beyond
+ * MAX_CONNECTIONS, or while CoDel is shedding, are turned away at once.
+ * Parameters: the listening socket */
+/**********************************************************************/
+void serve(int server_sock) {
+    struct pollfd * fds;
+    unsigned long long * idle_since;
+    unsigned long long now;
+    int returned[256];
+    ssize_t got;
+    int nfds = 2, fd, i, ready;
+    long n;
+
+    fds = (struct pollfd *)calloc(MAX_CONNECTIONS + 2, sizeof(struct pollfd));
+    idle_since = (unsigned long long *)calloc(MAX_CONNECTIONS + 2,
+                                              sizeof(unsigned long long));
+    workers = (struct worker *)calloc(WORKERS, sizeof(struct worker));
+    if ( !fds || !idle_since || !workers || pipe(wake_pipe) < 0 )
+        error_die("serve");
+
+    for ( i = 0; i < WORKERS; i++ ) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].ready, NULL);
+        pthread_mutex_init(&workers[i].trace.lock, NULL);
+        pthread_mutex_init(&workers[i].hot.lock, NULL);
+        if ( pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0 )
+            error_die("worker");
+    }
+
+    fcntl(server_sock, F_SETFL, O_NONBLOCK);
+    fds[0].fd = server_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_pipe[0];
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if ( poll(fds, nfds, 1000) < 0 && errno != EINTR )
+            error_die("poll");
+        now = now_ns();
+
+        /* connections handed back after a keep-alive response */
+        if ( fds[1].revents & POLLIN ) {
+            got = read(wake_pipe[0], returned, sizeof(returned));
+            for ( n = 0; n < got / (long)sizeof(int); n++ )
+                watch_connection(fds, idle_since, &nfds, returned[n], now);
+        }
+
+        for ( i = 2; i < nfds; ) {
+            fd = fds[i].fd;
+            if ( fds[i].revents || now - idle_since[i] > KEEP_ALIVE_TIMEOUT * 1000000000ULL ) {
+                ready = fds[i].revents & POLLIN;
+                fds[i] = fds[nfds - 1];
+                idle_since[i] = idle_since[nfds - 1];
+                nfds--;
+                if ( ready )
+                    dispatch_connection(fd, now);
+                else
+                    release_connection(fd, 0);
+                continue;
+            }
+            i++;
+        }
+
+        if ( fds[0].revents & POLLIN ) {
+            while ( (fd = accept(server_sock, NULL, NULL)) >= 0 ) {
+                #ifdef ENABLE_LOGGING
+                log("client connected");
+                #endif
+                if ( __sync_add_and_fetch(&open_connections, 1) > MAX_CONNECTIONS ||
+                     codel_dropping(now) )
+                    reject_connection(fd);
+                else
+                    watch_connection(fds, idle_since, &nfds, fd, now);
+            }
+        }
+    }
+}
+
+/**********************************************************************/
+/* Add a connection to the set polled for its next request. */
+/**********************************************************************/
+void watch_connection(struct pollfd * fds, unsigned long long * idle_since,
+                      int * nfds, int fd, unsigned long long now) {
+    struct timeval timeout;
+    int one = 1;
+
+    if ( *nfds >= MAX_CONNECTIONS + 2 ) {
+        release_connection(fd, 0);
+        return;
+    }
+
+    /* a worker never waits long on a client that stops mid request, and
+     * responses go out in several small writes that Nagle would delay */
+    timeout.tv_sec = REQUEST_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    fds[*nfds].fd = fd;
+    fds[*nfds].events = POLLIN;
+    fds[*nfds].revents = 0;
+    idle_since[*nfds] = now;
+    (*nfds)++;
+}
+
+/**********************************************************************/
+/* Queue a connection with a waiting request on the next worker that
+ * has room, or turn it away if every queue is full.
+ * Parameters: the connection
+ *             when its request was seen to be ready */
+/**********************************************************************/
+void dispatch_connection(int fd, unsigned long long ready_ns) {
+    static int next = 0;
+    struct worker * w;
+    int tries;
+
+    for ( tries = 0; tries < WORKERS; tries++ ) {
+        w = &workers[next];
+        next = (next + 1) % WORKERS;
+
+        pthread_mutex_lock(&w->lock);
+        if ( w->count < QUEUE_DEPTH ) {
+            w->queue[(w->head + w->count) % QUEUE_DEPTH].fd = fd;
+            w->queue[(w->head + w->count) % QUEUE_DEPTH].ready_ns = ready_ns;
+            w->count++;
+            pthread_cond_signal(&w->ready);
+            pthread_mutex_unlock(&w->lock);
+            return;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    reject_connection(fd);
+}
+
+/**********************************************************************/
+/* Answer a connection with 503 without queueing it.  Whatever part of
+ * the request has arrived is read first so that closing the socket
+ * does not reset the connection before the client sees the answer. */
+/**********************************************************************/
+void reject_connection(int fd) {
+    char buf[BUFFER_SIZE];
+
+    recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    overloaded(fd);
+    shutdown(fd, SHUT_WR);
+    release_connection(fd, 0);
+
+    pthread_mutex_lock(&admission_lock);
+    admission.rejected++;
+    pthread_mutex_unlock(&admission_lock);
+}
+
+/**********************************************************************/
+/* Give a connection back to the main thread to wait for its next
+ * request, or close it. */
+/**********************************************************************/
+void release_connection(int fd, int keep) {
+    if ( keep && write(wake_pipe[1], &fd, sizeof(fd)) == sizeof(fd) )
+        return;
+    close(fd);
+    __sync_sub_and_fetch(&open_connections, 1);
+}
+
+/**********************************************************************/
+/* Worker thread: serve one request at a time from its queue. */
+/**********************************************************************/
+void * worker_main(void * arg) {
+    struct worker * w = (struct worker *)arg;
+    struct queued_conn item;
+    unsigned long long now;
+    int keep;
+
+    hot_local = &w->hot;
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        while ( w->count == 0 )
+            pthread_cond_wait(&w->ready, &w->lock);
+        item = w->queue[w->head];
+        w->head = (w->head + 1) % QUEUE_DEPTH;
+        w->count--;
+        pthread_mutex_unlock(&w->lock);
+
+        now = now_ns();
+        request_ready_ns = item.ready_ns;
+        request_deadline_ns = now + REQUEST_TIMEOUT * 1000000000ULL;
+        request_shed = codel_should_drop(now - item.ready_ns, now);
+        if ( TRACE )
+            trace_begin(item.ready_ns, now);
+
+        keep = PROXY ? proxy_request(item.fd) : accept_request(item.fd);
+        if ( trace_current.active )
+            trace_end(&w->trace);
+        release_connection(item.fd, keep);
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* CoDel: once queueing delay has stayed above the target for a whole
+ * interval, drop requests at a rate that rises with the square root of
+ * the number dropped until the delay falls back under the target.
+ * Parameters: how long the request waited in the queue
+ *             the current time
+ * Returns: non-zero if this request should be dropped */
+/**********************************************************************/
+int codel_should_drop(unsigned long long sojourn, unsigned long long now) {
+    int ok_to_drop = 0, drop = 0;
+
+    pthread_mutex_lock(&admission_lock);
+    admission.dequeued++;
+    admission.sojourn_ns += sojourn;
+    codel.last_dequeue = now;
+
+    if ( sojourn < CODEL_TARGET_NS ) {
+        codel.first_above = 0;
+    } else if ( codel.first_above == 0 ) {
+        codel.first_above = now + CODEL_INTERVAL_NS;
+    } else if ( now >= codel.first_above ) {
+        ok_to_drop = 1;
+    }
+
+    if ( codel.dropping ) {
+        if ( !ok_to_drop ) {
+            codel.dropping = 0;
+        } else if ( now >= codel.drop_next ) {
+            codel.count++;
+            codel.drop_next = now + CODEL_INTERVAL_NS / sqrt(codel.count);
+            drop = 1;
+        }
+    } else if ( ok_to_drop ) {
+        /* resume near the old drop rate if we were dropping recently */
+        codel.dropping = 1;
+        if ( codel.count > 2 && now - codel.drop_next < 16 * CODEL_INTERVAL_NS )
+            codel.count -= 2;
+        else
+            codel.count = 1;
+        codel.drop_next = now + CODEL_INTERVAL_NS / sqrt(codel.count);
+        drop = 1;
+    }
+    pthread_mutex_unlock(&admission_lock);
+    return drop;
+}
+
+/**********************************************************************/
+/* Returns: non-zero while CoDel is shedding.  The state is only updated
+ * as requests are dequeued, so it lapses if nothing has been dequeued
+ * for an interval. */
+/**********************************************************************/
+int codel_dropping(unsigned long long now) {
+    int dropping;
+
+    pthread_mutex_lock(&admission_lock);
+    dropping = codel.dropping && now - codel.last_dequeue < CODEL_INTERVAL_NS;
+    pthread_mutex_unlock(&admission_lock);
+    return dropping;
+}
+
+/**********************************************************************/
+/* Returns: non-zero if the request has waited longer than the client
+ * said it would, so there is no point in serving it */
+/**********************************************************************/
+int request_expired(long deadline_ms) {
+    return deadline_ms > 0 &&
+           now_ns() - request_ready_ns > deadline_ms * 1000000ULL;
+}
+
+/**********************************************************************/
+
+void shed_request(int client) {
+    pthread_mutex_lock(&admission_lock);
+    if ( request_shed )
+        admission.shed++;
+    else
+        admission.expired++;
+    pthread_mutex_unlock(&admission_lock);
+    overloaded(client);
+}
+
+/**********************************************************************/
+/* Answer a request whose head did not arrive in time with 408 and
+ * close the connection.
+ * Returns: non-zero if the request timed out */
+/**********************************************************************/
+int head_timed_out(int client) {
+    if ( !request_deadline_ns || now_ns() < request_deadline_ns )
+        return 0;
+    pthread_mutex_lock(&admission_lock);
+    admission.timed_out++;
+    pthread_mutex_unlock(&admission_lock);
+    keep_alive = 0;
+    status_page(client, "408 Request Timeout");
+    return 1;
+}
+
+/**********************************************************************/
+/* Append the admission control counters to a /stats body.
+ * Returns: the number of characters written */
+/**********************************************************************/
+int admission_report(char * buf) {
+    int len;
+
+    pthread_mutex_lock(&admission_lock);
+    len = sprintf(buf, "connections_open %d\n"
+                       "connections_rejected %lu\n"
+                       "requests_shed %lu\n"
+                       "requests_expired %lu\n"
+                       "requests_timed_out %lu\n"
+                       "queue_wait_us_avg %.1f\n"
+                       "codel_dropping %d\n",
+                  open_connections, admission.rejected, admission.shed,
+                  admission.expired, admission.timed_out, admission.dequeued ?
+                  admission.sojourn_ns / 1000.0 / admission.dequeued : 0.0,
+                  codel.dropping);
+    pthread_mutex_unlock(&admission_lock);
+    return len;
+}
+
+/**********************************************************************/
+/* Count a read of a value in this worker's hot key sketch.  Only one
+ * read in HOT_SAMPLE is counted, which keeps the lock and the scan off
+ * most requests while the hottest keys still stand out.  The sketch is
+ * Space-Saving: a key not in a full sketch takes over the entry with
+ * the smallest count, inheriting that count, so the heaviest keys
+ * stay in with counts that overestimate by at most the minimum. */
+/**********************************************************************/
+void hot_record(const char * hash) {
+    struct hot_sketch * sketch = hot_local;
+    int i, min = 0;
+
+    if ( !sketch || HOT_SAMPLE == 0 || ++hot_skipped < HOT_SAMPLE )
+        return;
+    hot_skipped = 0;
+
+    pthread_mutex_lock(&sketch->lock);
+    for ( i = 0; i < sketch->used; i++ ) {
+        if ( sketch->entries[i].hash[0] == hash[0] &&
+             memcmp(sketch->entries[i].hash, hash, 32) == 0 ) {
+            sketch->entries[i].count++;
+            pthread_mutex_unlock(&sketch->lock);
+            return;
+        }
+        if ( sketch->entries[i].count < sketch->entries[min].count )
+            min = i;
+    }
+    if ( sketch->used < HOT_SKETCH_SIZE )
+        min = sketch->used++;
+    else
+        sketch->entries[min].count++;
+    if ( sketch->entries[min].count == 0 )
+        sketch->entries[min].count = 1;
+    memcpy(sketch->entries[min].hash, hash, 33);
+    pthread_mutex_unlock(&sketch->lock);
+}
+
+/**********************************************************************/
+
+int compare_hot_hashes(const void * a, const void * b) {
+    return strcmp(((const struct hot_entry *)a)->hash,
+                  ((const struct hot_entry *)b)->hash);
+}
+
+int compare_hot_counts(const void * a, const void * b) {
+    const struct hot_entry * x = (const struct hot_entry *)a;
+    const struct hot_entry * y = (const struct hot_entry *)b;
+
+    if ( x->count != y->count )
+        return x->count < y->count ? 1 : -1;
+    return 0;
+}
+
+/**********************************************************************/
+/* Merge the workers' sketches and write the hottest keys to the hot
+ * profile, one "[hash] [count]" line each, hottest first.  Counts are
+ * halved as they are taken so the profile follows recent traffic. */
+/**********************************************************************/
+void save_hot_profile() {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    struct hot_entry * merged;
+    char * text;
+    size_t count = 0, kept = 0, len = 0, i;
+    int w, e;
+
+    merged = (struct hot_entry *)malloc(sizeof(struct hot_entry) *
+                                        HOT_SKETCH_SIZE * WORKERS);
+    if ( !merged )
+        return;
+    for ( w = 0; w < WORKERS; w++ ) {
+        pthread_mutex_lock(&workers[w].hot.lock);
+        for ( e = 0; e < workers[w].hot.used; e++ ) {
+            merged[count++] = workers[w].hot.entries[e];
+            workers[w].hot.entries[e].count /= 2;
+        }
+        pthread_mutex_unlock(&workers[w].hot.lock);
+    }
+
+    /* the same key may be hot on several workers */
+    qsort(merged, count, sizeof(struct hot_entry), compare_hot_hashes);
+    for ( i = 0; i < count; i++ ) {
+        if ( kept > 0 && strcmp(merged[kept - 1].hash, merged[i].hash) == 0 )
+            merged[kept - 1].count += merged[i].count;
+        else
+            merged[kept++] = merged[i];
+    }
+    qsort(merged, kept, sizeof(struct hot_entry), compare_hot_counts);
+    if ( kept > HOT_PROFILE_SIZE )
+        kept = HOT_PROFILE_SIZE;
+
+    /* an idle server keeps the profile it started with */
+    text = kept ? (char *)malloc(kept * 56 + 1) : NULL;
+    if ( text ) {
+        for ( i = 0; i < kept; i++ )
+            len += sprintf(text + len, "%s %lu\n", merged[i].hash, merged[i].count);
+        sprintf(path, "%s%s", STORE, HOT_PROFILE);
+        sprintf(tmp, "%s%s.tmp", STORE, HOT_PROFILE);
+        if ( write_temp_file(tmp, (unsigned char *)text, len) == 0 )
+            rename(tmp, path);
+        free(text);
+    }
+    free(merged);
+}
+
+/**********************************************************************/
+/* Thread that saves the hot profile every HOT_SAVE_SECONDS. */
+/**********************************************************************/
+void * hot_profiler(void * arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(HOT_SAVE_SECONDS);
+        if ( workers )
+            save_hot_profile();
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* Start pulling the values in the hot profile into the page cache,
+ * WARMUP_THREADS at a time, while the server starts taking requests. */
+/**********************************************************************/
+void warmup_start() {
+    char path[BUFFER_SIZE];
+    char hash[64];
+    unsigned long count;
+    pthread_t thread;
+    FILE * file;
+    int i;
+
+    warmup.started_ns = now_ns();
+    warmup.finished_ns = warmup.started_ns;
+    sprintf(path, "%s%s", STORE, HOT_PROFILE);
+    file = fopen(path, "r");
+    if ( !file )
+        return;
+    warmup.hashes = (char (*)[33])malloc(33 * HOT_PROFILE_SIZE);
+    while ( warmup.hashes && warmup.total < HOT_PROFILE_SIZE &&
+            fscanf(file, "%63s %lu", hash, &count) == 2 ) {
+        if ( is_hash_name(hash) )
+            strcpy(warmup.hashes[warmup.total++], hash);
+    }
+    fclose(file);
+    if ( warmup.total == 0 )
+        return;
+
+    warmup.finished_ns = 0;
+    warmup.running = WARMUP_THREADS;
+    for ( i = 0; i < WARMUP_THREADS; i++ ) {
+        if ( pthread_create(&thread, NULL, warmup_worker, NULL) != 0 ) {
+            __sync_sub_and_fetch(&warmup.running, 1);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**********************************************************************/
+/* Warm-up thread: take the next profiled value, ask the kernel to read
+ * all of it ahead and then read it through so it is cached when the
+ * first request for it arrives. */
+/**********************************************************************/
+void * warmup_worker(void * arg) {
+    char path[BUFFER_SIZE];
+    char buf[BUFFER_SIZE];
+    unsigned long next;
+    off_t offset;
+    ssize_t got;
+    int fd;
+    (void)arg;
+
+    while ( (next = __sync_fetch_and_add(&warmup.claimed, 1)) < warmup.total ) {
+        sprintf(path, "%s%s", STORE, warmup.hashes[next]);
+        fd = open(path, O_RDONLY);
+        if ( fd >= 0 ) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            offset = 0;
+            while ( (got = pread(fd, buf, sizeof(buf), offset)) > 0 )
+                offset += got;
+            close(fd);
+            __sync_add_and_fetch(&warmup.bytes, (unsigned long)offset);
+        }
+        __sync_add_and_fetch(&warmup.done, 1);
+    }
+
+    if ( __sync_sub_and_fetch(&warmup.running, 1) == 0 )
+        warmup.finished_ns = now_ns();
+    return NULL;
+}
+
+/**********************************************************************/
+/* Start timing a request on this thread.
+ * Parameters: when the request was seen to be ready
+ *             when the worker picked it up */
+/**********************************************************************/
+void trace_begin(unsigned long long ready_ns, unsigned long long now) {
+    memset(&trace_current, 0, sizeof(trace_current));
+    trace_current.start_ns = ready_ns;
+    trace_current.phase_ns[PHASE_QUEUE] = now - ready_ns;
+    trace_current.active = 1;
+    trace_mark_ns = now;
+}
+
+/**********************************************************************/
+/* Charge the time since the last phase boundary to a phase. */
+/**********************************************************************/
+void trace_phase(int phase) {
+    unsigned long long now;
+
+    if ( !trace_current.active )
+        return;
+    now = now_ns();
+    trace_current.phase_ns[phase] += now - trace_mark_ns;
+    trace_mark_ns = now;
+}
+
+/**********************************************************************/
+/* Note the request's path.  The query string is left out: it carries
+ * the values being set, and the slow log is open to any client. */
+/**********************************************************************/
+void trace_url(const char * url) {
+    size_t len = strcspn(url, "?");
+
+    if ( len > TRACE_URL_SIZE - 1 )
+        len = TRACE_URL_SIZE - 1;
+    memcpy(trace_current.url, url, len);
+    trace_current.url[len] = 0x00;
+}
+
+/**********************************************************************/
+/* Record the request just served in a worker's ring. */
+/**********************************************************************/
+void trace_end(struct trace_ring * ring) {
+    trace_current.total_ns = now_ns() - trace_current.start_ns;
+    trace_current.active = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->records[ring->next % TRACE_RING] = trace_current;
+    ring->next++;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**********************************************************************/
+
+int compare_trace_records(const void * a, const void * b) {
+    const struct trace_record * x = (const struct trace_record *)a;
+    const struct trace_record * y = (const struct trace_record *)b;
+
+    if ( x->total_ns != y->total_ns )
+        return x->total_ns < y->total_ns ? 1 : -1;
+    return 0;
+}
+
+/**********************************************************************/
+/* List the slowest requests held in the workers' rings, slowest first,
+ * one per line with the time spent in each phase in microseconds.
+ * Parameters: the socket connected to the client
+ *             the query string: n=[count] limits the list (default
+ *             20) */
+/**********************************************************************/
+void slowlog(int client, char * query) {
+    struct trace_record * records;
+    char * body;
+    char * opt;
+    unsigned long long now, accounted;
+    size_t count = 0, limit = 20, len = 0, i;
+    int w, p;
+
+    if ( (opt = strstr(query, "n=")) && atol(opt + 2) > 0 )
+        limit = atol(opt + 2);
+
+    records = (struct trace_record *)malloc(sizeof(struct trace_record) *
+                                            TRACE_RING * WORKERS);
+    if ( !records ) {
+        unavailable(client);
+        return;
+    }
+    for ( w = 0; w < WORKERS; w++ ) {
+        pthread_mutex_lock(&workers[w].trace.lock);
+        for ( i = 0; i < TRACE_RING && i < workers[w].trace.next; i++ )
+            records[count++] = workers[w].trace.records[i];
+        pthread_mutex_unlock(&workers[w].trace.lock);
+    }
+    qsort(records, count, sizeof(struct trace_record), compare_trace_records);
+    if ( count > limit )
+        count = limit;
+
+    body = (char *)malloc(256 + count * (TRACE_URL_SIZE + 256));
+    if ( !body ) {
+        free(records);
+        unavailable(client);
+        return;
+    }
+    now = now_ns();
+    len += sprintf(body + len, "tracing %s\n", TRACE ? "on" : "off");
+    for ( i = 0; i < count; i++ ) {
+        len += sprintf(body + len, "%.1f", records[i].total_ns / 1000.0);
+        accounted = 0;
+        for ( p = 0; p < PHASE_COUNT; p++ ) {
+            len += sprintf(body + len, " %s=%.1f", PHASE_NAMES[p],
+                           records[i].phase_ns[p] / 1000.0);
+            accounted += records[i].phase_ns[p];
+        }
+        len += sprintf(body + len, " other=%.1f age_ms=%llu %s\n",
+                       records[i].total_ns > accounted ?
+                       (records[i].total_ns - accounted) / 1000.0 : 0.0,
+                       (now - records[i].start_ns) / 1000000, records[i].url);
+    }
+    text_response(client, body);
+    free(body);
+    free(records);
+}
+
+/**********************************************************************/
+/* Build the contents of a value file: the header followed by the value,
+ * compressed when allowed and that makes it meaningfully smaller.
+ * Parameters: the raw value and its length
+ *             non-zero to allow compression
+ *             set to the length of the returned buffer
+ * Returns: a malloc'd buffer, or NULL if allocation failed */
+/**********************************************************************/
+unsigned char * encode_value(const unsigned char * raw, unsigned int len,
+                             int compress, unsigned int * encoded_len) {
+    unsigned char * encoded;
+    int packed_len = 0;
+
+    encoded = (unsigned char *)malloc(VALUE_HEADER_SIZE + lz_bound(len));
+    if ( !encoded )
+        return NULL;
+
+    if ( compress && len >= COMPRESS_MIN ) {
+        packed_len = lz_compress(raw, len, encoded + VALUE_HEADER_SIZE,
+                                 len - len / 8);
+    }
+
+    memcpy(encoded, VALUE_MAGIC, 4);
+    encoded[4] = packed_len > 0 ? CODEC_LZ4 : CODEC_RAW;
+    encoded[5] = encoded[6] = encoded[7] = 0;
+    put32(encoded + 8, len);
+    put64(encoded + 16, value_etag(raw, len));
+    if ( packed_len > 0 ) {
+        put32(encoded + 12, packed_len);
+    } else {
+        put32(encoded + 12, len);
+        memcpy(encoded + VALUE_HEADER_SIZE, raw, len);
+    }
+    *encoded_len = VALUE_HEADER_SIZE + get32(encoded + 12);
+    return encoded;
+}
+
+/**********************************************************************/
+/* Read the header of an open value file.  Files without a header are
+ * described as raw values covering the whole file.
+ * Returns: 0 on success, -1 if the file could not be read */
+/**********************************************************************/
+int read_value_info(int fd, struct value_info * info) {
+    unsigned char header[VALUE_HEADER_SIZE];
+    struct stat st;
+    ssize_t got;
+
+    /* the header before the size: an append writes its bytes before
+     * the header that covers them, so the file is never shorter */
+    got = pread(fd, header, VALUE_HEADER_SIZE, 0);
+    if ( got < 0 || fstat(fd, &st) < 0 )
+        return -1;
+    return parse_value_info(header, got, st.st_size, info);
+}
+
+/**********************************************************************/
+/* Describe a value from the first bytes of its file.
+ * Parameters: up to VALUE_HEADER_SIZE bytes from the start of the file
+ *             how many bytes that is
+ *             the size of the whole file
+ *             the description to fill in
+ * Returns: 0 on success, -1 if the header is inconsistent */
+/**********************************************************************/
+int parse_value_info(const unsigned char * header, size_t got, size_t size,
+                     struct value_info * info) {
+    info->has_etag = 0;
+    info->etag = 0;
+    if ( got >= VALUE_HEADER_SIZE && memcmp(header, VALUE_MAGIC, 4) == 0 ) {
+        info->offset = VALUE_HEADER_SIZE;
+        info->has_etag = 1;
+        info->etag = get64(header + 16);
+    } else if ( got >= VALUE_HEADER_SIZE_V1 &&
+                memcmp(header, VALUE_MAGIC_V1, 4) == 0 ) {
+        info->offset = VALUE_HEADER_SIZE_V1;
+    } else {
+        info->codec = CODEC_RAW;
+        info->raw_len = size;
+        info->stored_len = size;
+        info->offset = 0;
+        return 0;
+    }
+
+    info->codec = header[4];
+    info->raw_len = get32(header + 8);
+    info->stored_len = get32(header + 12);
+    /* a file may run past stored_len while an append is in progress */
+    if ( info->codec > CODEC_LZ4 ||
+         info->stored_len > size - info->offset ||
+         ( info->codec != CODEC_RAW && info->stored_len != size - info->offset ) )
+        return -1;
+    return 0;
+}
+
+/**********************************************************************/
+/* Find the current version of a value, in the memtable or the store.
+ * Returns: 0 if the value exists, -1 otherwise, or -2 if the current
+ *          version is in the memtable but could not be copied */
+/**********************************************************************/
+int open_value(const char * hash, struct value_source * src) {
+    char path[BUFFER_SIZE];
+
+    src->fd = -1;
+    src->mem = NULL;
+    src->mem_len = 0;
+
+    if ( MEMTABLE ) {
+        switch ( memtable_get(hash, &src->mem, &src->mem_len) ) {
+        case MEM_ERROR:
+            return -2;
+        case MEM_DELETED:
+            return -1;
+        case MEM_HIT:
+            if ( parse_value_info(src->mem, src->mem_len, src->mem_len,
+                                  &src->info) < 0 ) {
+                close_value(src);
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    sprintf(path, "%s%s", STORE, hash);
+    src->fd = open(path, O_RDONLY);
+    if ( src->fd < 0 || read_value_info(src->fd, &src->info) < 0 ) {
+        close_value(src);
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* Read bytes of a value's file, counting from the start of the file.
+ * Returns: the number of bytes read, 0 at the end, -1 on error */
+/**********************************************************************/
+ssize_t read_value_at(struct value_source * src, void * buf, size_t len,
+                      size_t offset) {
+    if ( !src->mem )
+        return pread(src->fd, buf, len, offset);
+    if ( offset >= src->mem_len )
+        return 0;
+    if ( len > src->mem_len - offset )
+        len = src->mem_len - offset;
+    memcpy(buf, src->mem + offset, len);
+    return len;
+}
+
+/**********************************************************************/
+
+void close_value(struct value_source * src) {
+    if ( src->fd >= 0 )
+        close(src->fd);
+    free(src->mem);
+    src->fd = -1;
+    src->mem = NULL;
+}
+
+/**********************************************************************/
+/* Read and decode a whole value.
+ * Returns: a malloc'd buffer of raw_len bytes, or NULL on error */
+/**********************************************************************/
+unsigned char * load_value(struct value_source * src) {
+    struct value_info * info = &src->info;
+    unsigned char * stored;
+    unsigned char * raw;
+
+    stored = (unsigned char *)malloc(info->stored_len + 1);
+    if ( !stored )
+        return NULL;
+    if ( read_value_at(src, stored, info->stored_len, info->offset) !=
+         (ssize_t)info->stored_len ) {
+        free(stored);
+        return NULL;
+    }
+    TRACE_PHASE(PHASE_IO);
+    if ( info->codec == CODEC_RAW )
+        return stored;
+
+    raw = (unsigned char *)malloc(info->raw_len + 1);
+    if ( raw && lz_decompress(stored, info->stored_len, raw, info->raw_len)
+                != (int)info->raw_len ) {
+        free(raw);
+        raw = NULL;
+    }
+    free(stored);
+    TRACE_PHASE(PHASE_CODEC);
+    return raw;
+}
+
+/**********************************************************************/
+/* Stream a consistent dump of the store to the client.  The dump is
+ * produced by a child process so the server keeps taking writes; sets
+ * made while it runs preserve the old value for the child first.
+ * Parameters: the socket connected to the client */
+/**********************************************************************/
+void snapshot(int client) {
+    char buf[BUFFER_SIZE];
+    unsigned long long seq;
+    pid_t pid;
+    pthread_t thread;
+
+    if ( MEMTABLE )
+        pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&store_lock);
+    if ( snapshot_running() ) {
+        pthread_mutex_unlock(&store_lock);
+        if ( MEMTABLE )
+            pthread_mutex_unlock(&flush_lock);
+        unavailable(client);
+        return;
+    }
+
+    sprintf(buf, "%s%s", STORE, SNAPSHOT_DIR);
+    clear_dir(buf);
+    if ( mkdir(buf, 0755) < 0 ) {
+        pthread_mutex_unlock(&store_lock);
+        if ( MEMTABLE )
+            pthread_mutex_unlock(&flush_lock);
+        unavailable(client);
+        return;
+    }
+
+    /* the child reads the store, so it must hold every logged change */
+    if ( MEMTABLE && memtable_flush(1) < 0 ) {
+        clear_dir(buf);
+        pthread_mutex_unlock(&store_lock);
+        pthread_mutex_unlock(&flush_lock);
+        unavailable(client);
+        return;
+    }
+
+    /* every change logged after seq will preserve the value it replaces */
+    pthread_mutex_lock(&log_lock);
+    seq = log_seq;
+    pthread_mutex_unlock(&log_lock);
+    if ( REPLICA_HOST && !PRIMARY ) {
+        pthread_mutex_lock(&replica_lock);
+        seq = replica.applied;
+        pthread_mutex_unlock(&replica_lock);
+    }
+
+    pid = fork();
+    if ( pid == 0 ) {
+        char header[BUFFER_SIZE];
+
+        /* don't hold the listener, the log or other clients' sockets
+         * open for as long as the dump takes */
+        close_inherited(client);
+        sprintf(header, "HTTP/1.0 200 OK\r\n"
+                        "Connection: close\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "\r\n");
+        write_all(client, header, strlen(header));
+        dump_store(client, STORE, buf, NULL, seq);
+        close(client);
+        _exit(0);
+    } else if ( pid < 0 ) {
+        clear_dir(buf);
+        pthread_mutex_unlock(&store_lock);
+        if ( MEMTABLE )
+            pthread_mutex_unlock(&flush_lock);
+        unavailable(client);
+        return;
+    }
+    snapshot_pid = pid;
+    if ( pthread_create(&thread, NULL, snapshot_reaper, (void *)(long)pid) == 0 )
+        pthread_detach(thread);
+    pthread_mutex_unlock(&store_lock);
+    if ( MEMTABLE )
+        pthread_mutex_unlock(&flush_lock);
+}
+
+/**********************************************************************/
+/* Check whether a snapshot child is still streaming, removing the
+ * preserved values once it has finished.  Called with store_lock held.
+ * The reaper thread normally notices first; this covers a snapshot
+ * whose reaper could not be started.
+ * Returns: non-zero while a snapshot is in progress */
+/**********************************************************************/
+int snapshot_running() {
+    char buf[BUFFER_SIZE];
+
+    if ( snapshot_pid > 0 && waitpid(snapshot_pid, NULL, WNOHANG) != 0 ) {
+        snapshot_pid = 0;
+        sprintf(buf, "%s%s", STORE, SNAPSHOT_DIR);
+        clear_dir(buf);
+    }
+    return snapshot_pid > 0;
+}
+
+/**********************************************************************/
+/* Thread that waits for a snapshot child to exit and then drops the
+ * preserved values, so writers stop preserving as soon as it is done.
+ * Parameters: the child's pid */
+/**********************************************************************/
+void * snapshot_reaper(void * arg) {
+    pid_t pid = (pid_t)(long)arg;
+    char buf[BUFFER_SIZE];
+
+    while ( waitpid(pid, NULL, 0) < 0 && errno == EINTR )
+        ;
+    pthread_mutex_lock(&store_lock);
+    if ( snapshot_pid == pid ) {
+        snapshot_pid = 0;
+        sprintf(buf, "%s%s", STORE, SNAPSHOT_DIR);
+        clear_dir(buf);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return NULL;
+}
+
+/**********************************************************************/
+/* Close every descriptor above stderr except one, in a forked child.
+ * Parameters: the descriptor to keep */
+/**********************************************************************/
+void close_inherited(int keep) {
+    DIR * d;
+    struct dirent * entry;
+    int fd, max;
+
+    d = opendir("/proc/self/fd");
+    if ( d ) {
+        while ( (entry = readdir(d)) ) {
+            if ( !isdigit((int)entry->d_name[0]) )
+                continue;
+            fd = atoi(entry->d_name);
+            if ( fd > 2 && fd != keep && fd != dirfd(d) )
+                close(fd);
+        }
+        closedir(d);
+        return;
+    }
+    max = (int)sysconf(_SC_OPEN_MAX);
+    for ( fd = 3; fd < max; fd++ )
+        if ( fd != keep )
+            close(fd);
+}
+
+/**********************************************************************/
+/* Save the current version of a value for a running snapshot before it
+ * is replaced.  Only the first change after the snapshot started is
+ * kept.  A value that did not exist yet is recorded with an ".absent"
+ * marker so the snapshot skips it.
+ * Parameters: the hash of the key about to change */
+/**********************************************************************/
+void preserve(const char * hash) {
+    char path[BUFFER_SIZE];
+    char saved[BUFFER_SIZE];
+    char absent[BUFFER_SIZE];
+    int fd;
+
+    sprintf(path, "%s%s", STORE, hash);
+    sprintf(saved, "%s%s%s", STORE, SNAPSHOT_DIR, hash);
+    sprintf(absent, "%s%s%s.absent", STORE, SNAPSHOT_DIR, hash);
+
+    if ( access(saved, F_OK) == 0 || access(absent, F_OK) == 0 )
+        return;
+    if ( link(path, saved) < 0 && errno == ENOENT ) {
+        fd = open(absent, O_WRONLY | O_CREAT, 0644);
+        if ( fd >= 0 )
+            close(fd);
+    }
+}
+
+/**********************************************************************/
+
+int compare_hashes(const void * a, const void * b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/**********************************************************************/
+/* Append the names of all value files in a directory to a growing
+ * array of hashes.
+ * Returns: the new number of hashes, or -1 if allocation failed */
+/**********************************************************************/
+long list_hashes(const char * dir, char (** hashes)[33], long count, long * size) {
+    DIR * d;
+    struct dirent * entry;
+
+    d = opendir(dir);
+    if ( !d )
+        return count;
+    while ( count >= 0 && (entry = readdir(d)) ) {
+        if ( is_hash_name(entry->d_name) )
+            count = add_hash(hashes, count, size, entry->d_name);
+    }
+    closedir(d);
+    return count;
+}
+
+/**********************************************************************/
+/* Returns: the new number of hashes, or -1 if allocation failed */
+/**********************************************************************/
+long add_hash(char (** hashes)[33], long count, long * size, const char * hash) {
+    char (* grown)[33];
+
+    if ( count == *size ) {
+        *size = *size ? *size * 2 : 1024;
+        grown = (char (*)[33])realloc(*hashes, *size * 33);
+        if ( !grown )
+            return -1;
+        *hashes = grown;
+    }
+    strcpy((*hashes)[count++], hash);
+    return count;
+}
+
+/**********************************************************************/
+/* Open the version of a value that belongs in a snapshot: a preserved
+ * copy if the value changed after the snapshot started, otherwise the
+ * live file.  The preserved directory is checked again after opening
+ * the live file in case the value was replaced in between.
+ * Returns: a file descriptor, or -1 if the value is not in the snapshot */
+/**********************************************************************/
+int open_snapshot_value(const char * store, const char * preserved, const char * hash) {
+    char path[BUFFER_SIZE];
+    char absent[BUFFER_SIZE];
+    int fd;
+
+    sprintf(path, "%s%s", store, hash);
+    fd = open(path, O_RDONLY);
+    if ( !preserved )
+        return fd;
+
+    sprintf(path, "%s%s", preserved, hash);
+    sprintf(absent, "%s%s.absent", preserved, hash);
+    if ( access(path, F_OK) == 0 ) {
+        if ( fd >= 0 )
+            close(fd);
+        return open(path, O_RDONLY);
+    }
+    if ( access(absent, F_OK) == 0 ) {
+        if ( fd >= 0 )
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**********************************************************************/
+
+void put32(unsigned char * p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+unsigned int get32(const unsigned char * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+void put64(unsigned char * p, unsigned long long v) {
+    put32(p, v & 0xffffffff);
+    put32(p+4, v >> 32);
+}
+
+unsigned long long get64(const unsigned char * p) {
+    return get32(p) | ((unsigned long long)get32(p+4) << 32);
+}
+
+/**********************************************************************/
+/* Compress, checksum and write one block of a dump.
+ * Returns: 0 on success, -1 on a write error */
+/**********************************************************************/
+int write_dump_block(int fd, unsigned char * block, unsigned int len) {
+    unsigned char header[12];
+    unsigned char * packed;
+    int packed_len;
+    int result;
+
+    packed = (unsigned char *)malloc(lz_bound(len));
+    if ( !packed )
+        return -1;
+    packed_len = lz_compress(block, len, packed, lz_bound(len));
+    if ( packed_len <= 0 || (unsigned int)packed_len >= len )
+        packed_len = 0;
+
+    put32(header, len);
+    put32(header+4, packed_len ? packed_len : len);
+    put32(header+8, crc32(block, len));
+    result = write_all(fd, header, sizeof(header));
+    if ( result == 0 && packed_len )
+        result = write_all(fd, packed, packed_len);
+    else if ( result == 0 )
+        result = write_all(fd, block, len);
+    free(packed);
+    return result;
+}
+
+/**********************************************************************/
+/* Stream a dump of a store to a file descriptor.  Values are written
+ * in hash order.  If preserved is not NULL it names the directory of
+ * values saved by preserve(), which are used instead of live files.
+ * If overlay is not NULL its changes are dumped in place of the files.
+ * Parameters: the descriptor to write to
+ *             the store directory
+ *             the preserved directory, or NULL
+ *             a table of changes not yet in the store, or NULL
+ *             the change log sequence number the dump is consistent with
+ * Returns: the number of records written, or -1 on error */
+/**********************************************************************/
+long dump_store(int fd, const char * store, const char * preserved,
+                struct mem_table * overlay, unsigned long long seq) {
+    char (* hashes)[33] = NULL;
+    long count = 0, size = 0, records = 0, i;
+    unsigned char * block;
+    unsigned int block_len = 0, block_size = DUMP_BLOCK_SIZE;
+    unsigned char * grown;
+    unsigned char end[12];
+    unsigned char header[8];
+    struct mem_entry * entry = NULL;
+    struct stat st;
+    off_t value_len;
+    int value = -1;
+
+    count = list_hashes(store, &hashes, count, &size);
+    if ( preserved && count >= 0 )
+        count = list_hashes(preserved, &hashes, count, &size);
+    for ( i = 0; overlay && count >= 0 && i < MEMTABLE_BUCKETS; i++ ) {
+        for ( entry = overlay->buckets[i]; entry && count >= 0; entry = entry->next )
+            count = add_hash(&hashes, count, &size, entry->hash);
+    }
+    block = (unsigned char *)malloc(block_size);
+    if ( count < 0 || !block ) {
+        free(hashes);
+        free(block);
+        return -1;
+    }
+    qsort(hashes, count, 33, compare_hashes);
+
+    put64(header, seq);
+    if ( write_all(fd, DUMP_MAGIC, strlen(DUMP_MAGIC)) < 0 ||
+         write_all(fd, header, sizeof(header)) < 0 )
+        records = -1;
+
+    for ( i = 0; i < count && records >= 0; i++ ) {
+        if ( i > 0 && strcmp(hashes[i], hashes[i-1]) == 0 )
+            continue;
+        entry = overlay ? memtable_find(overlay, hashes[i]) : NULL;
+        if ( entry && entry->deleted )
+            continue;
+        if ( entry ) {
+            value_len = entry->len;
+        } else {
+            value = open_snapshot_value(store, preserved, hashes[i]);
+            if ( value < 0 )
+                continue;
+            if ( fstat(value, &st) < 0 ) {
+                close(value);
+                continue;
+            }
+            value_len = st.st_size;
+        }
+
+        if ( block_len > 0 && block_len + 36 + value_len > block_size ) {
+            if ( write_dump_block(fd, block, block_len) < 0 )
+                records = -1;
+            block_len = 0;
+        }
+        if ( 36 + value_len > block_size ) {
+            block_size = 36 + value_len;
+            grown = (unsigned char *)realloc(block, block_size);
+            if ( !grown ) {
+                if ( !entry )
+                    close(value);
+                records = -1;
+                break;
+            }
+            block = grown;
+        }
+
+        memcpy(block + block_len, hashes[i], 32);
+        if ( entry )
+            memcpy(block + block_len + 36, entry->data, value_len);
+        if ( entry || read_all(value, block + block_len + 36, value_len) == 0 ) {
+            put32(block + block_len + 32, value_len);
+            block_len += 36 + value_len;
+            if ( records >= 0 )
+                records++;
+        }
+        if ( !entry )
+            close(value);
+    }
+
+    if ( records >= 0 && block_len > 0 && write_dump_block(fd, block, block_len) < 0 )
+        records = -1;
+    memset(end, 0, sizeof(end));
+    if ( records >= 0 && write_all(fd, end, sizeof(end)) < 0 )
+        records = -1;
+
+    free(block);
+    free(hashes);
+    return records;
+}
+
+/**********************************************************************/
+/* Load a dump into a store.  Value files are written directly from the
+ * dump blocks without going through set().
+ * Parameters: the descriptor to read the dump from
+ *             the store directory
+ *             set to the change log sequence number of the dump
+ * Returns: the number of records loaded, or -1 if the dump is corrupt */
+/**********************************************************************/
+long load_store(int fd, const char * store, unsigned long long * seq) {
+    char magic[8];
+    char hash[33];
+    unsigned char header[12];
+    unsigned char * packed = NULL;
+    unsigned char * block = NULL;
+    unsigned int raw_len, stored_len, offset, value_len;
+    long records = 0;
+
+    if ( read_all(fd, magic, sizeof(magic)) < 0 ||
+         memcmp(magic, DUMP_MAGIC, sizeof(magic)) != 0 ||
+         read_all(fd, header, 8) < 0 )
+        return -1;
+    *seq = get64(header);
+
+    while ( records >= 0 ) {
+        if ( read_all(fd, header, sizeof(header)) < 0 ) {
+            records = -1;
+            break;
+        }
+        raw_len = get32(header);
+        stored_len = get32(header+4);
+        if ( raw_len == 0 )
+            break;
+        if ( stored_len > raw_len || raw_len > 0x40000000 ) {
+            records = -1;
+            break;
+        }
+
+        free(packed);
+        free(block);
+        packed = (unsigned char *)malloc(stored_len);
+        block = (unsigned char *)malloc(raw_len);
+        if ( !packed || !block || read_all(fd, packed, stored_len) < 0 ) {
+            records = -1;
+            break;
+        }
+        if ( stored_len == raw_len ) {
+            memcpy(block, packed, raw_len);
+        } else if ( lz_decompress(packed, stored_len, block, raw_len) != (int)raw_len ) {
+            records = -1;
+            break;
+        }
+        if ( crc32(block, raw_len) != get32(header+8) ) {
+            records = -1;
+            break;
+        }
+
+        for ( offset = 0; offset < raw_len; offset += 36 + value_len ) {
+            if ( raw_len - offset < 36 ) {
+                records = -1;
+                break;
+            }
+            memcpy(hash, block + offset, 32);
+            hash[32] = 0x00;
+            value_len = get32(block + offset + 32);
+            if ( !is_hash_name(hash) || value_len > raw_len - offset - 36 ) {
+                records = -1;
+                break;
+            }
+            if ( write_value_file(store, hash, block + offset + 36, value_len) < 0 ) {
+                records = -1;
+                break;
+            }
+            records++;
+        }
+    }
+
+    free(packed);
+    free(block);
+    return records;
+}
+
+/**********************************************************************/
+/* Atomically replace a value file with the given bytes.  This is the
+ * bulk load path: it neither preserves for snapshots nor logs.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int write_value_file(const char * store, const char * hash,
+                     const unsigned char * data, size_t len) {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+
+    sprintf(path, "%s%s", store, hash);
+    sprintf(tmp, "%s%s.%lx.tmp", store, hash, (unsigned long)pthread_self());
+    if ( write_temp_file(tmp, data, len) < 0 )
+        return -1;
+    return rename(tmp, path);
+}
+
+/**********************************************************************/
+
+int write_temp_file(const char * tmp, const unsigned char * data, size_t len) {
+    int fd;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 )
+        return -1;
+    if ( write_all(fd, data, len) < 0 ) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**********************************************************************/
+/* Replace a value in the live store.  The old version is preserved if
+ * a snapshot is streaming and the change is appended to the change log
+ * on a primary, all under store_lock so that the log order matches the
+ * order the files changed in.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int store_value(const char * hash, const unsigned char * data, size_t len) {
+    pthread_mutex_t * lock = key_lock(hash);
+    int result;
+
+    pthread_mutex_lock(lock);
+    result = replace_value(hash, data, len);
+    pthread_mutex_unlock(lock);
+    return result;
+}
+
+/* As store_value(), called with the value's key lock held. */
+int replace_value(const char * hash, const unsigned char * data, size_t len) {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    int result;
+
+    if ( MEMTABLE )
+        return memtable_store(hash, data, len, 0);
+
+    sprintf(path, "%s%s", STORE, hash);
+    sprintf(tmp, "%s%s.%lx.tmp", STORE, hash, (unsigned long)pthread_self());
+    if ( write_temp_file(tmp, data, len) < 0 )
+        return -1;
+
+    pthread_mutex_lock(&store_lock);
+    if ( snapshot_pid > 0 && snapshot_running() )
+        preserve(hash);
+    result = rename(tmp, path);
+    if ( result == 0 && log_fd >= 0 )
+        log_append(LOG_SET, hash, data, len);
+    pthread_mutex_unlock(&store_lock);
+    return result;
+}
+
+/**********************************************************************/
+
+int remove_value(const char * hash) {
+    char path[BUFFER_SIZE];
+    pthread_mutex_t * lock = key_lock(hash);
+    int result;
+
+    pthread_mutex_lock(lock);
+    if ( MEMTABLE ) {
+        result = memtable_store(hash, NULL, 0, 1);
+        pthread_mutex_unlock(lock);
+        return result;
+    }
+
+    sprintf(path, "%s%s", STORE, hash);
+
+    pthread_mutex_lock(&store_lock);
+    if ( snapshot_pid > 0 && snapshot_running() )
+        preserve(hash);
+    result = unlink(path);
+    if ( result == 0 && log_fd >= 0 )
+        log_append(LOG_DELETE, hash, NULL, 0);
+    pthread_mutex_unlock(&store_lock);
+    pthread_mutex_unlock(lock);
+    return result;
+}
+
+/**********************************************************************/
+/* The lock that serialises writers of a value. */
+/**********************************************************************/
+pthread_mutex_t * key_lock(const char * hash) {
+    char prefix[3];
+
+    memcpy(prefix, hash, 2);
+    prefix[2] = 0x00;
+    return &key_locks[strtoul(prefix, NULL, 16) % KEY_LOCKS];
+}
+
+/**********************************************************************/
+/* Write bytes into a stored value at an offset.  The whole change is
+ * made under the value's key lock, so a set cannot slip in between
+ * reading the old value and writing the new one.
+ *
+ * For a raw value only the change is written and logged, as a patch.
+ * Bytes added at the end go straight into the live file, header last,
+ * so readers see either the old length or the new one.  Bytes that
+ * overwrite part of the value go into a copy of the file that is then
+ * renamed into place, so readers never see a mix of old and new.
+ *
+ * A compressed value is decoded and rewritten whole, uncompressed, so
+ * that later partial writes to it take the paths above; a full /set/
+ * compresses it again.  In memtable mode every partial write rewrites
+ * the whole value.  The new ETag chains the old one with the change,
+ * so it never needs the whole value.
+ * Parameters: the value's hash
+ *             where to write, which may be at most the value's length
+ *             non-zero to write at the end of the value instead
+ *             the bytes to write and their count
+ * Returns: 0 on success, -1 on error, -2 if the offset is past the end */
+/**********************************************************************/
+int patch_value(const char * hash, unsigned long long offset, int append,
+                const unsigned char * data, size_t len) {
+    pthread_mutex_t * lock = key_lock(hash);
+    int result;
+
+    pthread_mutex_lock(lock);
+    result = patch_raw(hash, offset, append, data, len);
+    if ( result == 1 )
+        result = patch_rewrite(hash, offset, append, data, len);
+    pthread_mutex_unlock(lock);
+    return result;
+}
+
+/**********************************************************************/
+/* Returns: as patch_value(), or 1 if the value must be rewritten */
+/**********************************************************************/
+int patch_raw(const char * hash, unsigned long long offset, int append,
+              const unsigned char * data, size_t len) {
+    char path[BUFFER_SIZE];
+    struct value_info info;
+    unsigned long long end;
+    int fd, result;
+
+    if ( MEMTABLE )
+        return 1;
+    sprintf(path, "%s%s", STORE, hash);
+    fd = open(path, O_RDWR);
+    if ( fd < 0 )
+        return 1;
+    if ( read_value_info(fd, &info) < 0 || info.codec != CODEC_RAW ||
+         info.offset != VALUE_HEADER_SIZE ) {
+        close(fd);
+        return 1;
+    }
+
+    if ( append )
+        offset = info.raw_len;
+    end = offset + len > info.raw_len ? offset + len : info.raw_len;
+    if ( offset > info.raw_len )
+        result = -2;
+    else if ( end > 0xffffffffULL )
+        result = -1;
+    else if ( offset == info.raw_len )
+        result = patch_append(fd, hash, &info, data, len);
+    else
+        result = patch_copy(fd, hash, &info, offset, data, len);
+    close(fd);
+    return result;
+}
+
+/**********************************************************************/
+/* Add bytes to the end of a raw value file.  A snapshot may be reading
+ * the same file, so while one runs the value is copied instead.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int patch_append(int fd, const char * hash, struct value_info * info,
+                 const unsigned char * data, size_t len) {
+    int result = -1;
+
+    pthread_mutex_lock(&store_lock);
+    if ( snapshot_pid > 0 && snapshot_running() ) {
+        pthread_mutex_unlock(&store_lock);
+        return patch_copy(fd, hash, info, info->raw_len, data, len);
+    }
+    /* until the header covers them, readers do not see the new bytes */
+    if ( pwrite(fd, data, len, VALUE_HEADER_SIZE + info->raw_len) == (ssize_t)len &&
+         write_raw_header(fd, info->raw_len + len,
+                          etag_chain(info->etag, info->raw_len, data, len)) == 0 ) {
+        result = 0;
+        log_patch(hash, info->raw_len, data, len);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return result;
+}
+
+/**********************************************************************/
+/* Overwrite bytes of a raw value in a copy of its file and rename the
+ * copy into place.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int patch_copy(int fd, const char * hash, struct value_info * info,
+               unsigned long long offset, const unsigned char * data, size_t len) {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    unsigned long long end;
+    int out, result = -1;
+
+    sprintf(path, "%s%s", STORE, hash);
+    sprintf(tmp, "%s%s.%lx.tmp", STORE, hash, (unsigned long)pthread_self());
+    out = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ( out < 0 )
+        return -1;
+
+    end = offset + len > info->raw_len ? offset + len : info->raw_len;
+    if ( copy_file(fd, out, VALUE_HEADER_SIZE + info->raw_len) == 0 &&
+         pwrite(out, data, len, VALUE_HEADER_SIZE + offset) == (ssize_t)len &&
+         write_raw_header(out, end, etag_chain(info->etag, offset, data, len)) == 0 )
+        result = 0;
+    close(out);
+    if ( result < 0 ) {
+        unlink(tmp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&store_lock);
+    if ( snapshot_pid > 0 && snapshot_running() )
+        preserve(hash);
+    result = rename(tmp, path);
+    if ( result == 0 )
+        log_patch(hash, offset, data, len);
+    pthread_mutex_unlock(&store_lock);
+    return result;
+}
+
+/**********************************************************************/
+/* Decode a value, make the change and store the result uncompressed.
+ * Returns: as patch_value() */
+/**********************************************************************/
+int patch_rewrite(const char * hash, unsigned long long offset, int append,
+                  const unsigned char * data, size_t len) {
+    struct value_source src;
+    unsigned char * old = NULL;
+    unsigned char * raw;
+    unsigned char * encoded;
+    unsigned int old_len = 0, encoded_len;
+    unsigned long long old_etag = 0, end;
+    int result, found;
+
+    found = open_value(hash, &src);
+    if ( found == -2 )
+        return -1;
+    if ( found == 0 ) {
+        old = load_value(&src);
+        close_value(&src);
+        if ( !old )
+            return -1;
+        old_len = src.info.raw_len;
+        old_etag = src.info.etag;
+    }
+
+    if ( append )
+        offset = old_len;
+    end = offset + len > old_len ? offset + len : old_len;
+    if ( offset > old_len || end > 0xffffffffULL ) {
+        free(old);
+        return offset > old_len ? -2 : -1;
+    }
+
+    raw = (unsigned char *)malloc(end + 1);
+    if ( !raw ) {
+        free(old);
+        return -1;
+    }
+    if ( old_len )
+        memcpy(raw, old, old_len);
+    memcpy(raw + offset, data, len);
+    free(old);
+
+    encoded = encode_value(raw, end, 0, &encoded_len);
+    if ( encoded )
+        put64(encoded + 16, etag_chain(old_etag, offset, data, len));
+    result = encoded ? replace_value(hash, encoded, encoded_len) : -1;
+    free(encoded);
+    free(raw);
+    return result;
+}
+
+/**********************************************************************/
+/* Set the lengths and ETag in the header of a raw value file. */
+/**********************************************************************/
+int write_raw_header(int fd, unsigned long long len, unsigned long long etag) {
+    unsigned char fields[16];
+
+    put32(fields, len);
+    put32(fields + 4, len);
+    put64(fields + 8, etag);
+    return pwrite(fd, fields, sizeof(fields), 8) == (ssize_t)sizeof(fields) ? 0 : -1;
+}
+
+/**********************************************************************/
+/* Log a partial write: the offset followed by the bytes written.
+ * Called with store_lock held. */
+/**********************************************************************/
+void log_patch(const char * hash, unsigned long long offset,
+               const unsigned char * data, size_t len) {
+    unsigned char * record;
+
+    if ( log_fd < 0 )
+        return;
+    record = (unsigned char *)malloc(8 + len);
+    if ( !record )
+        error_die("changelog");
+    put64(record, offset);
+    memcpy(record + 8, data, len);
+    log_append(LOG_PATCH, hash, record, 8 + len);
+    free(record);
+}
+
+/**********************************************************************/
+/* Copy the first len bytes of one file to another.  copy_file_range()
+ * keeps the data in the kernel, and may share the blocks on file
+ * systems that can; where it is not supported the copy is read and
+ * written here.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int copy_file(int in, int out, size_t len) {
+    char buf[BUFFER_SIZE];
+    loff_t in_off = 0, out_off = 0;
+    ssize_t got;
+
+    while ( len > 0 ) {
+        got = copy_file_range(in, &in_off, out, &out_off, len, 0);
+        if ( got <= 0 )
+            break;
+        len -= got;
+    }
+    while ( len > 0 ) {
+        got = pread(in, buf, len < BUFFER_SIZE ? len : BUFFER_SIZE, in_off);
+        if ( got <= 0 || pwrite(out, buf, got, out_off) != got )
+            return -1;
+        in_off += got;
+        out_off += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* Log a change and keep it in the memtable.  A writer that finds the
+ * memtable full waits for the flusher to make room.
+ * Parameters: the value's hash
+ *             the value file's bytes, for a set
+ *             their length
+ *             non-zero for a delete
+ * Returns: 0 on success, -1 on error or when deleting a missing value */
+/**********************************************************************/
+int memtable_store(const char * hash, const unsigned char * data, size_t len,
+                   int deleted) {
+    char path[BUFFER_SIZE];
+    struct mem_entry * entry;
+    int exists;
+
+    pthread_mutex_lock(&memtable_lock);
+    if ( memtable_active->bytes >= MEMTABLE_MAX ) {
+        memtable.stalls++;
+        while ( memtable_active->bytes >= MEMTABLE_MAX ) {
+            pthread_cond_signal(&memtable_full);
+            pthread_cond_wait(&memtable_drained, &memtable_lock);
+        }
+    }
+    pthread_mutex_unlock(&memtable_lock);
+
+    entry = (struct mem_entry *)calloc(1, sizeof(struct mem_entry));
+    if ( !entry )
+        return -1;
+    strcpy(entry->hash, hash);
+    entry->deleted = deleted;
+    if ( !deleted ) {
+        entry->data = (unsigned char *)malloc(len + 1);
+        if ( !entry->data ) {
+            free(entry);
+            return -1;
+        }
+        memcpy(entry->data, data, len);
+        entry->len = len;
+    }
+
+    pthread_mutex_lock(&store_lock);
+    if ( deleted ) {
+        exists = memtable_get(hash, NULL, NULL);
+        if ( exists == MEM_MISS ) {
+            sprintf(path, "%s%s", STORE, hash);
+            exists = access(path, F_OK) == 0 ? MEM_HIT : MEM_DELETED;
+        }
+        if ( exists != MEM_HIT ) {
+            pthread_mutex_unlock(&store_lock);
+            free(entry);
+            return -1;
+        }
+    }
+    log_append(deleted ? LOG_DELETE : LOG_SET, hash, data, len);
+
+    pthread_mutex_lock(&memtable_lock);
+    memtable_put(memtable_active, entry);
+    memtable.writes++;
+    if ( memtable_active->bytes >= MEMTABLE_MAX / 2 )
+        pthread_cond_signal(&memtable_full);
+    pthread_mutex_unlock(&memtable_lock);
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+/**********************************************************************/
+
+unsigned int memtable_bucket(const char * hash) {
+    char prefix[5];
+
+    memcpy(prefix, hash, 4);
+    prefix[4] = 0x00;
+    return strtoul(prefix, NULL, 16);
+}
+
+/**********************************************************************/
+/* Add an entry to a table, replacing any entry for the same hash.
+ * Called with memtable_lock held. */
+/**********************************************************************/
+void memtable_put(struct mem_table * table, struct mem_entry * entry) {
+    struct mem_entry ** link;
+    struct mem_entry * old;
+    int cmp = 1;
+
+    link = &table->buckets[memtable_bucket(entry->hash)];
+    while ( *link && (cmp = strcmp((*link)->hash, entry->hash)) < 0 )
+        link = &(*link)->next;
+
+    if ( *link && cmp == 0 ) {
+        old = *link;
+        entry->next = old->next;
+        table->count--;
+        table->bytes -= old->len + sizeof(struct mem_entry);
+        free(old->data);
+        free(old);
+        memtable.coalesced++;
+    } else {
+        entry->next = *link;
+    }
+    *link = entry;
+    table->count++;
+    table->bytes += entry->len + sizeof(struct mem_entry);
+}
+
+/**********************************************************************/
+/* Called with memtable_lock held. */
+/**********************************************************************/
+struct mem_entry * memtable_find(struct mem_table * table, const char * hash) {
+    struct mem_entry * entry;
+    int cmp;
+
+    for ( entry = table->buckets[memtable_bucket(hash)]; entry; entry = entry->next ) {
+        cmp = strcmp(entry->hash, hash);
+        if ( cmp == 0 )
+            return entry;
+        if ( cmp > 0 )
+            break;
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* Look a value up in the memtable.
+ * Parameters: the value's hash
+ *             where to put a malloc'd copy of the value file's bytes,
+ *             or NULL to only check for the value
+ *             where to put their length
+ * Returns: MEM_HIT, MEM_DELETED if the latest change was a delete,
+ *          MEM_MISS if the store holds the current version, or
+ *          MEM_ERROR if the copy could not be made */
+/**********************************************************************/
+int memtable_get(const char * hash, unsigned char ** data, unsigned int * len) {
+    struct mem_entry * entry;
+    int result = MEM_MISS;
+
+    pthread_mutex_lock(&memtable_lock);
+    entry = memtable_find(memtable_active, hash);
+    if ( !entry )
+        entry = memtable_find(memtable_flushing, hash);
+    if ( entry && entry->deleted ) {
+        result = MEM_DELETED;
+    } else if ( entry ) {
+        result = MEM_HIT;
+        if ( data ) {
+            *data = (unsigned char *)malloc(entry->len + 1);
+            if ( *data ) {
+                memcpy(*data, entry->data, entry->len);
+                *len = entry->len;
+            } else {
+                /* the store may hold an older version, or a deleted one */
+                result = MEM_ERROR;
+            }
+        }
+    }
+    pthread_mutex_unlock(&memtable_lock);
+    return result;
+}
+
+/**********************************************************************/
+/* Look up a value's header in the memtable without copying the value.
+ * Returns: MEM_HIT with info filled in, MEM_DELETED, MEM_MISS, or
+ *          MEM_ERROR if the entry's header is damaged */
+/**********************************************************************/
+int memtable_info(const char * hash, struct value_info * info) {
+    struct mem_entry * entry;
+    int result = MEM_MISS;
+
+    pthread_mutex_lock(&memtable_lock);
+    entry = memtable_find(memtable_active, hash);
+    if ( !entry )
+        entry = memtable_find(memtable_flushing, hash);
+    if ( entry && entry->deleted )
+        result = MEM_DELETED;
+    else if ( entry )
+        result = parse_value_info(entry->data, entry->len, entry->len, info) < 0 ?
+                 MEM_ERROR : MEM_HIT;
+    pthread_mutex_unlock(&memtable_lock);
+    return result;
+}
+
+/**********************************************************************/
+/* Called with memtable_lock held. */
+/**********************************************************************/
+void memtable_clear(struct mem_table * table) {
+    struct mem_entry * entry;
+    struct mem_entry * next;
+    int i;
+
+    for ( i = 0; i < MEMTABLE_BUCKETS; i++ ) {
+        for ( entry = table->buckets[i]; entry; entry = next ) {
+            next = entry->next;
+            free(entry->data);
+            free(entry);
+        }
+        table->buckets[i] = NULL;
+    }
+    table->count = 0;
+    table->bytes = 0;
+}
+
+/**********************************************************************/
+/* Write everything in the active table to the store, in hash order.
+ * The table is first swapped out so writers can carry on filling a new
+ * one.  Called with flush_lock held.  A flush that failed leaves its
+ * table behind, and no new table is swapped out until that one has
+ * been written, so writers wait once the active table fills up.
+ * Parameters: non-zero if the caller also holds store_lock, in which
+ *             case the store is fully up to date with the log when
+ *             this succeeds
+ * Returns: 0 on success, -1 if the store could not be written */
+/**********************************************************************/
+int memtable_flush(int locked) {
+    struct mem_table * swap;
+    unsigned long long through;
+    unsigned long count;
+
+    if ( memtable_flushing->count > 0 && memtable_write(locked) < 0 )
+        return -1;
+
+    if ( !locked )
+        pthread_mutex_lock(&store_lock);
+    pthread_mutex_lock(&log_lock);
+    through = log_seq;
+    pthread_mutex_unlock(&log_lock);
+    pthread_mutex_lock(&memtable_lock);
+    swap = memtable_flushing;
+    memtable_flushing = memtable_active;
+    memtable_active = swap;
+    memtable_flushing_seq = through;
+    count = memtable_flushing->count;
+    pthread_cond_broadcast(&memtable_drained);
+    pthread_mutex_unlock(&memtable_lock);
+    if ( !locked )
+        pthread_mutex_unlock(&store_lock);
+
+    if ( count == 0 )
+        return 0;
+    return memtable_write(locked);
+}
+
+/**********************************************************************/
+/* Write the flushing table to the store and empty it.  On error the
+ * table is kept, so reads still find its changes and the next flush
+ * writes it again; the changes are in the log either way.
+ * Parameters: non-zero if the caller holds store_lock
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int memtable_write(int locked) {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    struct mem_entry * entry;
+    unsigned long count;
+    int i, result = 0, err = 0;
+
+    /* only the flushing thread changes the flushing table, so it can be
+     * walked without memtable_lock */
+    for ( i = 0; i < MEMTABLE_BUCKETS && result == 0; i++ ) {
+        for ( entry = memtable_flushing->buckets[i]; entry && result == 0; entry = entry->next ) {
+            sprintf(path, "%s%s", STORE, entry->hash);
+            sprintf(tmp, "%s%s.%lx.tmp", STORE, entry->hash,
+                    (unsigned long)pthread_self());
+            if ( !entry->deleted && write_temp_file(tmp, entry->data, entry->len) < 0 ) {
+                err = errno;
+                result = -1;
+                break;
+            }
+
+            if ( !locked )
+                pthread_mutex_lock(&store_lock);
+            if ( snapshot_pid > 0 && snapshot_running() )
+                preserve(entry->hash);
+            if ( entry->deleted ) {
+                if ( unlink(path) < 0 && errno != ENOENT ) {
+                    err = errno;
+                    result = -1;
+                }
+            } else if ( rename(tmp, path) < 0 ) {
+                err = errno;
+                unlink(tmp);
+                result = -1;
+            }
+            if ( !locked )
+                pthread_mutex_unlock(&store_lock);
+        }
+    }
+
+    pthread_mutex_lock(&memtable_lock);
+    if ( result < 0 ) {
+        memtable.flush_errors++;
+    } else {
+        count = memtable_flushing->count;
+        memtable_clear(memtable_flushing);
+        memtable.flushes++;
+        memtable.flushed += count;
+    }
+    pthread_mutex_unlock(&memtable_lock);
+
+    if ( result < 0 ) {
+        errno = err;
+        perror("memtable flush");
+        return -1;
+    }
+    save_memtable_state(memtable_flushing_seq);
+    return 0;
+}
+
+/**********************************************************************/
+/* Flusher thread: flush when the memtable is half full or every
+ * MEMTABLE_FLUSH_MS, and let the change log rotate once it is full by
+ * flushing everything with writers held off. */
+/**********************************************************************/
+void * memtable_flusher(void * arg) {
+    struct timespec until;
+    unsigned long end;
+    int failed;
+    (void)arg;
+
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += MEMTABLE_FLUSH_MS / 1000;
+        until.tv_nsec += (MEMTABLE_FLUSH_MS % 1000) * 1000000L;
+        if ( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&memtable_lock);
+        while ( memtable_active->bytes < MEMTABLE_MAX / 2 &&
+                pthread_cond_timedwait(&memtable_full, &memtable_lock, &until) == 0 )
+            ;
+        pthread_mutex_unlock(&memtable_lock);
+
+        pthread_mutex_lock(&log_lock);
+        end = log_end;
+        pthread_mutex_unlock(&log_lock);
+
+        pthread_mutex_lock(&flush_lock);
+        if ( end > LOG_MAX_SIZE ) {
+            pthread_mutex_lock(&store_lock);
+            failed = memtable_flush(1) < 0;
+            if ( !failed ) {
+                pthread_mutex_lock(&log_lock);
+                log_rotate();
+                pthread_mutex_unlock(&log_lock);
+            }
+            pthread_mutex_unlock(&store_lock);
+        } else {
+            failed = memtable_flush(0) < 0;
+        }
+        pthread_mutex_unlock(&flush_lock);
+
+        /* the store could not be written, out of space perhaps; writers
+         * wait on the full memtable while this retries */
+        if ( failed )
+            sleep(1);
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* Start buffering writes.  Called after the change log is open. */
+/**********************************************************************/
+void memtable_setup() {
+    pthread_t thread;
+
+    memtable_active = (struct mem_table *)calloc(1, sizeof(struct mem_table));
+    memtable_flushing = (struct mem_table *)calloc(1, sizeof(struct mem_table));
+    if ( !memtable_active || !memtable_flushing )
+        error_die("memtable");
+    save_memtable_state(log_seq);
+    if ( pthread_create(&thread, NULL, memtable_flusher, NULL) != 0 )
+        error_die("memtable");
+    pthread_detach(thread);
+}
+
+/**********************************************************************/
+/* Write changes that were only in the memtable when the server last
+ * stopped, replaying them from the change log.  Does nothing unless
+ * memtable.state shows the store was last run with a memtable. */
+/**********************************************************************/
+void memtable_recover() {
+    char path[BUFFER_SIZE];
+    unsigned long long through;
+
+    if ( memtable_replay(NULL, ~0ULL, &through) == 0 )
+        return;
+
+    if ( MEMTABLE ) {
+        save_memtable_state(through);
+    } else {
+        sprintf(path, "%s%s", STORE, MEMTABLE_STATE);
+        unlink(path);
+    }
+}
+
+/**********************************************************************/
+/* Replay the changes logged after the sequence number in memtable.state,
+ * either into the store or into a table in memory.  --dump uses the
+ * table so that it leaves the store and memtable.state alone.
+ * Parameters: the table to fill, or NULL to write the store
+ *             the last sequence number to replay
+ *             set to the sequence number of the last change replayed
+ * Returns: 1 if the store has a memtable.state, 0 if it has none */
+/**********************************************************************/
+int memtable_replay(struct mem_table * table, unsigned long long last,
+                    unsigned long long * through) {
+    char path[BUFFER_SIZE];
+    struct log_reader reader;
+    struct log_record record;
+    struct mem_entry * entry;
+    FILE * file;
+    int fd;
+
+    *through = 0;
+    sprintf(path, "%s%s", STORE, MEMTABLE_STATE);
+    file = fopen(path, "r");
+    if ( !file )
+        return 0;
+    if ( fscanf(file, "%llu", through) != 1 )
+        *through = 0;
+    fclose(file);
+
+    sprintf(path, "%s%s", STORE, LOG_NAME);
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 )
+        return 1;
+    lseek(fd, LOG_HEADER_SIZE, SEEK_SET);
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = fd;
+    while ( read_log_record(&reader, &record) == 1 && record.seq <= last ) {
+        if ( record.seq <= *through )
+            continue;
+        *through = record.seq;
+        if ( record.op != LOG_SET && record.op != LOG_DELETE )
+            continue;
+        if ( table ) {
+            entry = (struct mem_entry *)calloc(1, sizeof(struct mem_entry));
+            if ( !entry )
+                error_die("memtable replay");
+            strcpy(entry->hash, record.hash);
+            entry->deleted = record.op == LOG_DELETE;
+            if ( !entry->deleted ) {
+                entry->data = (unsigned char *)malloc(record.len + 1);
+                if ( !entry->data )
+                    error_die("memtable replay");
+                memcpy(entry->data, record.data, record.len);
+                entry->len = record.len;
+            }
+            memtable_put(table, entry);
+        } else if ( record.op == LOG_SET ) {
+            if ( write_value_file(STORE, record.hash, record.data, record.len) < 0 )
+                error_die("memtable recovery");
+        } else {
+            sprintf(path, "%s%s", STORE, record.hash);
+            unlink(path);
+        }
+    }
+    free(reader.buf);
+    close(fd);
+    return 1;
+}
+
+/**********************************************************************/
+
+void save_memtable_state(unsigned long long seq) {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    char buf[32];
+
+    sprintf(path, "%s%s", STORE, MEMTABLE_STATE);
+    sprintf(tmp, "%s%s.tmp", STORE, MEMTABLE_STATE);
+    sprintf(buf, "%llu\n", seq);
+    if ( write_temp_file(tmp, (unsigned char *)buf, strlen(buf)) == 0 )
+        rename(tmp, path);
+}
+
+/**********************************************************************/
+/* Returns: non-zero if a store holds any value files */
+/**********************************************************************/
+int has_values(const char * store) {
+    DIR * d;
+    struct dirent * entry;
+    int found = 0;
+
+    d = opendir(store);
+    if ( !d )
+        return 0;
+    while ( !found && (entry = readdir(d)) )
+        found = is_hash_name(entry->d_name);
+    closedir(d);
+    return found;
+}
+
+/**********************************************************************/
+/* Value files are named by the 32 character hex md5 of their key. */
+/**********************************************************************/
+int is_hash_name(const char * name) {
+    int i;
+
+    for ( i = 0; i < 32; i++ ) {
+        if ( !isxdigit(name[i]) )
+            return 0;
+    }
+    return name[32] == 0x00;
+}
+
+/**********************************************************************/
+/* Remove a directory and the files in it. */
+/**********************************************************************/
+void clear_dir(const char * dir) {
+    char path[BUFFER_SIZE];
+    DIR * d;
+    struct dirent * entry;
+
+    d = opendir(dir);
+    if ( !d )
+        return;
+    while ( (entry = readdir(d)) ) {
+        if ( entry->d_name[0] == '.' )
+            continue;
+        sprintf(path, "%s%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/**********************************************************************/
+/* Write or read exactly len bytes, retrying short transfers.
+ * Returns: 0 on success, -1 on error or end of file */
+/**********************************************************************/
+int write_all(int fd, const void * buf, size_t len) {
+    const char * p = (const char *)buf;
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = write(fd, p, len);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, void * buf, size_t len) {
+    char * p = (char *)buf;
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = read(fd, p, len);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* 64 bit FNV-1a of a raw value, stored in its header as the ETag. */
+/**********************************************************************/
+unsigned long long value_etag(const unsigned char * buf, size_t len) {
+    return fnv1a(0xcbf29ce484222325ULL, buf, len);
+}
+
+unsigned long long fnv1a(unsigned long long h, const unsigned char * buf,
+                         size_t len) {
+    while ( len-- ) {
+        h ^= *buf++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**********************************************************************/
+/* The ETag of a value after a partial write: the hash carried on from
+ * the old ETag through the offset and the bytes written. */
+/**********************************************************************/
+unsigned long long etag_chain(unsigned long long etag, unsigned long long offset,
+                              const unsigned char * data, size_t len) {
+    unsigned char pos[8];
+
+    put64(pos, offset);
+    return fnv1a(fnv1a(etag, pos, sizeof(pos)), data, len);
+}
+
+/**********************************************************************/
+/* Parse the offset= of a partial write: decimal digits only.
+ * Returns: 0 with the offset filled in, -1 if it is malformed or
+ *          beyond the largest value length a header can record */
+/**********************************************************************/
+int parse_offset(const char * text, unsigned long long * offset) {
+    char * end;
+
+    if ( !isdigit((int)text[0]) )
+        return -1;
+    errno = 0;
+    *offset = strtoull(text, &end, 10);
+    return *end || errno == ERANGE || *offset > 0xffffffffULL ? -1 : 0;
+}
+
+/**********************************************************************/
+/* Parse a Range header against a value of the given size.  Only a
+ * single range of bytes is served; anything else is ignored and the
+ * whole value sent.
+ * Returns: 1 with the first and last byte filled in, 0 to ignore the
+ *          header, -1 if the range lies outside the value */
+/**********************************************************************/
+int parse_range(const char * range, unsigned int size,
+                unsigned int * first, unsigned int * last) {
+    unsigned long long a, b;
+    char * end;
+
+    while ( ISspace(*range) )
+        range++;
+    if ( strncasecmp(range, "bytes=", 6) != 0 || strchr(range, ',') )
+        return 0;
+    range += 6;
+
+    if ( *range == '-' ) {
+        /* the last b bytes */
+        b = strtoull(range + 1, &end, 10);
+        if ( end == range + 1 )
+            return 0;
+        if ( b == 0 || size == 0 )
+            return -1;
+        *first = b >= size ? 0 : size - b;
+        *last = size - 1;
+        return 1;
+    }
+
+    a = strtoull(range, &end, 10);
+    if ( end == range || *end != '-' )
+        return 0;
+    range = end + 1;
+    b = strtoull(range, &end, 10);
+    if ( end == range )
+        b = size - 1ULL;
+    else if ( b < a )
+        return 0;
+    if ( a >= size )
+        return -1;
+    *first = a;
+    *last = b >= size ? size - 1 : b;
+    return 1;
+}
+
+/**********************************************************************/
+/* Check an If-None-Match header against a value's ETag.  The lz4 and
+ * raw forms of a value share the hash, so either matches, as does "*".
+ * Returns: non-zero if the client's copy is current */
+/**********************************************************************/
+int etag_matches(const char * if_none_match, struct value_info * info) {
+    char tag[20];
+
+    if ( strchr(if_none_match, '*') )
+        return 1;
+    if ( !info->has_etag )
+        return 0;
+    sprintf(tag, "\"%016llx", info->etag);
+    return strstr(if_none_match, tag) != NULL;
+}
+
+/**********************************************************************/
+/* Standard CRC-32 (as used by zlib and gzip) for dump block checks. */
+/**********************************************************************/
+unsigned int crc32(const unsigned char * buf, size_t len) {
+    static unsigned int table[256];
+    static int table_ready = 0;
+    unsigned int crc, c;
+    int i, k;
+
+    if ( !table_ready ) {
+        for ( i = 0; i < 256; i++ ) {
+            c = i;
+            for ( k = 0; k < 8; k++ )
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+
+    crc = 0xffffffff;
+    while ( len-- )
+        crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+/**********************************************************************/
+/* Open the change log of a primary, creating it if needed.  A record
+ * torn by a crash is cut off the end of the log.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int log_open() {
+    char path[BUFFER_SIZE];
+    unsigned char header[LOG_HEADER_SIZE];
+    struct stat st;
+    int fd;
+
+    sprintf(path, "%s%s", STORE, LOG_NAME);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if ( fd < 0 || fstat(fd, &st) < 0 )
+        return -1;
+
+    if ( st.st_size == 0 ) {
+        /* values stored before the log existed are not in it: they count
+         * as change 1, so a new replica has to start from a snapshot */
+        log_base = has_values(STORE) ? 2 : 1;
+        log_seq = log_base - 1;
+        memcpy(header, LOG_MAGIC, 8);
+        put64(header + 8, log_base);
+        if ( write_all(fd, header, sizeof(header)) < 0 ) {
+            close(fd);
+            return -1;
+        }
+        log_end = LOG_HEADER_SIZE;
+    } else if ( log_scan(fd, &log_base, &log_seq, &log_end) < 0 ||
+                ftruncate(fd, log_end) < 0 ) {
+        close(fd);
+        return -1;
+    }
+
+    lseek(fd, log_end, SEEK_SET);
+    log_fd = fd;
+    return 0;
+}
+
+/**********************************************************************/
+/* Find the first sequence number, the last sequence number and the end
+ * of the last complete record of a change log.
+ * Returns: 0 on success, -1 if the file is not a change log */
+/**********************************************************************/
+int log_scan(int fd, unsigned long long * base, unsigned long long * last,
+             unsigned long * end) {
+    unsigned char header[LOG_HEADER_SIZE];
+    struct log_reader reader;
+    struct log_record record;
+
+    if ( pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+         memcmp(header, LOG_MAGIC, 8) != 0 )
+        return -1;
+    *base = get64(header + 8);
+    *last = *base - 1;
+
+    lseek(fd, LOG_HEADER_SIZE, SEEK_SET);
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = fd;
+    while ( read_log_record(&reader, &record) == 1 )
+        *last = record.seq;
+    *end = LOG_HEADER_SIZE + reader.consumed;
+    free(reader.buf);
+    return 0;
+}
+
+/**********************************************************************/
+/* Append a change to the log and wake any replicas following it.
+ * Called with store_lock held.  A primary that cannot log a change
+ * would silently diverge from its replicas, so failures are fatal. */
+/**********************************************************************/
+void log_append(char op, const char * hash, const unsigned char * data,
+                unsigned int len) {
+    unsigned char * record;
+    size_t size;
+
+    record = (unsigned char *)malloc(LOG_RECORD_OVERHEAD + len);
+    if ( !record )
+        error_die("changelog");
+
+    pthread_mutex_lock(&log_lock);
+    size = encode_log_record(record, op, log_seq + 1, now_ms(), hash, data, len);
+    if ( write_all(log_fd, record, size) < 0 )
+        error_die("changelog");
+    log_seq++;
+    log_end += size;
+    /* with a memtable the log holds unflushed changes, so the flusher
+     * rotates it once they are all written */
+    if ( log_end > LOG_MAX_SIZE && !MEMTABLE )
+        log_rotate();
+    pthread_cond_broadcast(&log_appended);
+    pthread_mutex_unlock(&log_lock);
+
+    free(record);
+}
+
+/**********************************************************************/
+/* Start a new, empty change log.  Followers still reading the old file
+ * finish it through their open descriptor and then move on; replicas
+ * further behind than that reload from a snapshot.  Called with
+ * log_lock held. */
+/**********************************************************************/
+void log_rotate() {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    unsigned char header[LOG_HEADER_SIZE];
+    int fd;
+
+    sprintf(path, "%s%s", STORE, LOG_NAME);
+    sprintf(tmp, "%s%s.tmp", STORE, LOG_NAME);
+    memcpy(header, LOG_MAGIC, 8);
+    put64(header + 8, log_seq + 1);
+    if ( write_temp_file(tmp, header, sizeof(header)) < 0 ||
+         rename(tmp, path) < 0 )
+        return;
+
+    fd = open(path, O_WRONLY | O_APPEND);
+    if ( fd < 0 )
+        error_die("changelog");
+    close(log_fd);
+    log_fd = fd;
+    log_base = log_seq + 1;
+    log_end = LOG_HEADER_SIZE;
+    log_generation++;
+}
+
+/**********************************************************************/
+
+size_t encode_log_record(unsigned char * out, char op, unsigned long long seq,
+                         unsigned long long time, const char * hash,
+                         const unsigned char * data, unsigned int len) {
+    put64(out, seq);
+    put64(out + 8, time);
+    out[16] = op;
+    memcpy(out + 17, hash, 32);
+    put32(out + 49, len);
+    if ( len )
+        memcpy(out + 53, data, len);
+    put32(out + 53 + len, crc32(out, 53 + len));
+    return LOG_RECORD_OVERHEAD + len;
+}
+
+/**********************************************************************/
+/* Decode one change log record.  The record's data points into buf.
+ * Returns: the size of the record, 0 if buf holds only part of one,
+ *          or -1 if it is corrupt */
+/**********************************************************************/
+long parse_log_record(const unsigned char * buf, size_t avail,
+                      struct log_record * record) {
+    unsigned int len;
+
+    if ( avail < 53 )
+        return 0;
+    len = get32(buf + 49);
+    if ( len > 0x40000000 )
+        return -1;
+    if ( avail < LOG_RECORD_OVERHEAD + len )
+        return 0;
+    if ( crc32(buf, 53 + len) != get32(buf + 53 + len) )
+        return -1;
+
+    record->seq = get64(buf);
+    record->time = get64(buf + 8);
+    record->op = buf[16];
+    memcpy(record->hash, buf + 17, 32);
+    record->hash[32] = 0x00;
+    record->data = buf + 53;
+    record->len = len;
+    if ( record->op != LOG_SET && record->op != LOG_DELETE &&
+         record->op != LOG_PATCH && record->op != LOG_HEARTBEAT )
+        return -1;
+    if ( !is_hash_name(record->hash) )
+        return -1;
+    return LOG_RECORD_OVERHEAD + len;
+}
+
+/**********************************************************************/
+/* Read the next record from a log file or stream.  The record's data
+ * is only valid until the next call.
+ * Returns: 1 for a record, 0 at a clean end of stream, -1 on error */
+/**********************************************************************/
+int read_log_record(struct log_reader * reader, struct log_record * record) {
+    unsigned char * grown;
+    ssize_t got;
+    long size;
+
+    while (1) {
+        size = parse_log_record(reader->buf + reader->start,
+                                reader->end - reader->start, record);
+        if ( size > 0 ) {
+            reader->start += size;
+            reader->consumed += size;
+            return 1;
+        } else if ( size < 0 ) {
+            return -1;
+        }
+
+        if ( reader->start > 0 ) {
+            memmove(reader->buf, reader->buf + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if ( reader->end == reader->size ) {
+            reader->size = reader->size ? reader->size * 2 : 4 * BUFFER_SIZE;
+            grown = (unsigned char *)realloc(reader->buf, reader->size);
+            if ( !grown )
+                return -1;
+            reader->buf = grown;
+        }
+
+        got = read(reader->fd, reader->buf + reader->end,
+                   reader->size - reader->end);
+        if ( got < 0 && errno == EINTR )
+            continue;
+        if ( got <= 0 )
+            return reader->end == reader->start ? 0 : -1;
+        reader->end += got;
+    }
+}
+
+/**********************************************************************/
+/* Returns: non-zero if the next record can be read without blocking */
+/**********************************************************************/
+int log_record_buffered(struct log_reader * reader) {
+    struct log_record record;
+
+    return parse_log_record(reader->buf + reader->start,
+                            reader->end - reader->start, &record) > 0;
+}
+
+/**********************************************************************/
+/* Start streaming the change log to a replica from the sequence number
+ * given as ?from=.  The stream is served by its own thread so that a
+ * replica can stay connected indefinitely.
+ * Parameters: the socket connected to the replica
+ *             the query string of the request */
+/**********************************************************************/
+struct follower {
+    int client;
+    unsigned long long from;
+};
+
+void follow_log(int client, char * query) {
+    char buf[BUFFER_SIZE];
+    struct follower * f;
+    pthread_t thread;
+    char * from;
+    int ok;
+
+    from = strstr(query, "from=");
+    if ( !PRIMARY || !from ) {
+        not_found(client);
+        return;
+    }
+
+    f = (struct follower *)malloc(sizeof(struct follower));
+    if ( !f ) {
+        unavailable(client);
+        return;
+    }
+    f->from = strtoull(from + 5, NULL, 10);
+
+    /* replicas behind the log, or ahead of it, must reload a snapshot */
+    pthread_mutex_lock(&log_lock);
+    ok = f->from >= log_base && f->from <= log_seq + 1;
+    pthread_mutex_unlock(&log_lock);
+    if ( !ok ) {
+        free(f);
+        gone(client);
+        return;
+    }
+
+    sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                 "Connection: close\r\n"
+                 "Content-Type: application/octet-stream\r\n"
+                 "\r\n");
+    send(client, buf, strlen(buf), 0);
+
+    f->client = dup(client);
+    if ( f->client < 0 ||
+         pthread_create(&thread, NULL, log_follower, f) != 0 ) {
+        if ( f->client >= 0 )
+            close(f->client);
+        free(f);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/**********************************************************************/
+/* Stream change log records to one replica until it disconnects.  A
+ * heartbeat carrying the latest sequence number is sent at least once
+ * a second so the replica can measure its lag. */
+/**********************************************************************/
+void * log_follower(void * arg) {
+    struct follower * f = (struct follower *)arg;
+    char path[BUFFER_SIZE];
+    unsigned char buf[BUFFER_SIZE];
+    unsigned char beat[LOG_RECORD_OVERHEAD];
+    unsigned long offset, end, generation;
+    unsigned long long seq, last_beat = 0;
+    struct timespec deadline;
+    struct stat st;
+    ssize_t got;
+    int fd, idle;
+
+    sprintf(path, "%s%s", STORE, LOG_NAME);
+    pthread_mutex_lock(&log_lock);
+    fd = open(path, O_RDONLY);
+    generation = log_generation;
+    end = log_end;
+    pthread_mutex_unlock(&log_lock);
+
+    /* skip records the replica already has */
+    offset = LOG_HEADER_SIZE;
+    while ( fd >= 0 && offset < end ) {
+        if ( pread(fd, buf, 53, offset) != 53 || get64(buf) >= f->from )
+            break;
+        offset += LOG_RECORD_OVERHEAD + get32(buf + 49);
+    }
+
+    while ( fd >= 0 ) {
+        idle = 0;
+        pthread_mutex_lock(&log_lock);
+        if ( generation == log_generation && offset >= log_end ) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            if ( pthread_cond_timedwait(&log_appended, &log_lock, &deadline) != 0 )
+                idle = 1;
+        }
+        seq = log_seq;
+        if ( generation == log_generation ) {
+            end = log_end;
+        } else if ( fstat(fd, &st) == 0 && offset < (unsigned long)st.st_size ) {
+            end = st.st_size;
+        } else if ( log_generation == generation + 1 ) {
+            close(fd);
+            fd = open(path, O_RDONLY);
+            generation = log_generation;
+            offset = LOG_HEADER_SIZE;
+            end = log_end;
+        } else {
+            end = offset;
+            close(fd);
+            fd = -1;
+        }
+        pthread_mutex_unlock(&log_lock);
+        if ( fd < 0 )
+            break;
+
+        while ( offset < end ) {
+            got = pread(fd, buf, end - offset < BUFFER_SIZE ? end - offset : BUFFER_SIZE, offset);
+            if ( got <= 0 || write_all(f->client, buf, got) < 0 )
+                break;
+            offset += got;
+        }
+        if ( offset < end )
+            break;
+
+        if ( idle || now_ms() - last_beat >= 1000 ) {
+            last_beat = now_ms();
+            encode_log_record(beat, LOG_HEARTBEAT, seq, last_beat,
+                              "00000000000000000000000000000000", NULL, 0);
+            if ( write_all(f->client, beat, sizeof(beat)) < 0 )
+                break;
+        }
+    }
+
+    if ( fd >= 0 )
+        close(fd);
+    close(f->client);
+    free(f);
+    return NULL;
+}
+
+/**********************************************************************/
+/* Replica thread: tail the primary's change log, reloading from a
+ * snapshot whenever the primary no longer has the records we need. */
+/**********************************************************************/
+void * replicate(void * arg) {
+    char path[BUFFER_SIZE];
+    unsigned long long applied;
+    int sock, status = 0, failures;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&replica_lock);
+        applied = replica.applied;
+        failures = replica.failures;
+        pthread_mutex_unlock(&replica_lock);
+
+        /* without a saved position nothing is known about the store, so
+         * start from a snapshot; so too once the store has diverged
+         * from the log far enough that the next record keeps failing */
+        sprintf(path, "%s%s", STORE, REPLICA_STATE);
+        if ( failures < REPLICA_RETRIES && access(path, F_OK) == 0 ) {
+            sprintf(path, "/log/?from=%llu", applied + 1);
+            sock = http_get(REPLICA_HOST, REPLICA_PORT, path, &status);
+        } else {
+            sock = -1;
+            status = 410;
+        }
+        if ( sock >= 0 && status == 200 ) {
+            apply_log(sock);
+        } else if ( status == 410 ) {
+            if ( sock >= 0 )
+                close(sock);
+            sock = http_get(REPLICA_HOST, REPLICA_PORT, "/snapshot", &status);
+            if ( sock >= 0 && status == 200 && resync(sock) == 0 ) {
+                close(sock);
+                continue;
+            }
+        }
+        if ( sock >= 0 )
+            close(sock);
+
+        pthread_mutex_lock(&replica_lock);
+        replica.connected = 0;
+        pthread_mutex_unlock(&replica_lock);
+        sleep(1);
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* Apply change log records as they arrive.  The primary streams
+ * without waiting for acknowledgements, so everything already received
+ * is applied as one batch before the applied position is saved.  A
+ * record that fails stops the stream with the position before it, so
+ * that it is tried again rather than skipped.
+ * Parameters: the socket streaming the primary's log
+ * Returns: 0 when the stream ends, -1 if a record could not be applied */
+/**********************************************************************/
+int apply_log(int sock) {
+    struct log_reader reader;
+    struct log_record record;
+    unsigned long long applied;
+    int result = 0;
+
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = sock;
+
+    pthread_mutex_lock(&replica_lock);
+    replica.connected = 1;
+    replica.last_contact = now_ms();
+    applied = replica.applied;
+    pthread_mutex_unlock(&replica_lock);
+
+    while ( read_log_record(&reader, &record) == 1 ) {
+        if ( record.op != LOG_HEARTBEAT ) {
+            if ( record.seq != applied + 1 )
+                break;
+            if ( apply_record(&record) < 0 )
+                result = -1;
+        }
+
+        pthread_mutex_lock(&replica_lock);
+        replica.last_contact = now_ms();
+        if ( record.seq > replica.primary_seq )
+            replica.primary_seq = record.seq;
+        if ( result < 0 ) {
+            replica.apply_errors++;
+            replica.failures = replica.failed_seq == record.seq ? replica.failures + 1 : 1;
+            replica.failed_seq = record.seq;
+        } else if ( record.op != LOG_HEARTBEAT ) {
+            replica.applied = record.seq;
+            replica.applied_time = record.time;
+            replica.failures = 0;
+        }
+        pthread_mutex_unlock(&replica_lock);
+        if ( result < 0 )
+            break;
+        if ( record.op != LOG_HEARTBEAT )
+            applied = record.seq;
+
+        if ( !log_record_buffered(&reader) )
+            save_replica_state(applied);
+    }
+
+    save_replica_state(applied);
+    free(reader.buf);
+    return result;
+}
+
+/**********************************************************************/
+/* Apply one change log record to the store.  A delete of a value the
+ * replica does not have counts as a failure: the primary only logs
+ * deletes of values it had, so the stores have diverged.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int apply_record(struct log_record * record) {
+    if ( record->op == LOG_SET )
+        return store_value(record->hash, record->data, record->len);
+    if ( record->op == LOG_PATCH )
+        return record->len >= 8 &&
+               patch_value(record->hash, get64(record->data), 0,
+                           record->data + 8, record->len - 8) == 0 ? 0 : -1;
+    if ( record->op == LOG_DELETE )
+        return remove_value(record->hash);
+    return 0;
+}
+
+/**********************************************************************/
+/* Replace the replica's store with a snapshot from the primary.  The
+ * snapshot is loaded into a staging directory first, so the old values
+ * are served until it is complete and kept if it is cut short.
+ * Parameters: the socket streaming the snapshot
+ * Returns: 0 on success, -1 if the snapshot was cut short */
+/**********************************************************************/
+int resync(int sock) {
+    char path[BUFFER_SIZE];
+    unsigned long long seq;
+
+    sprintf(path, "%s%s", STORE, RESYNC_DIR);
+    clear_dir(path);
+    if ( mkdir(path, 0755) < 0 )
+        return -1;
+    if ( load_store(sock, path, &seq) < 0 ) {
+        clear_dir(path);
+        return -1;
+    }
+
+    /* a restart part way through must not resume from the old position */
+    sprintf(path, "%s%s", STORE, REPLICA_STATE);
+    unlink(path);
+    pthread_mutex_lock(&replica_lock);
+    replica.applied = 0;
+    pthread_mutex_unlock(&replica_lock);
+
+    sprintf(path, "%s%s", STORE, RESYNC_DIR);
+    if ( install_values(path) < 0 ) {
+        clear_dir(path);
+        return -1;
+    }
+    clear_dir(path);
+
+    save_replica_state(seq);
+    pthread_mutex_lock(&replica_lock);
+    replica.applied = seq;
+    replica.applied_time = now_ms();
+    replica.failures = 0;
+    if ( seq > replica.primary_seq )
+        replica.primary_seq = seq;
+    pthread_mutex_unlock(&replica_lock);
+    return 0;
+}
+
+/**********************************************************************/
+/* Make the live store match a loaded snapshot.  Values the snapshot
+ * does not have are removed, then the loaded files are renamed over
+ * the live ones, so every key stays readable throughout.
+ * Parameters: the directory the snapshot was loaded into
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int install_values(const char * staging) {
+    char path[BUFFER_SIZE];
+    char loaded[BUFFER_SIZE];
+    char (* hashes)[33] = NULL;
+    long count, size = 0, i;
+    int result = 0;
+
+    count = list_hashes(STORE, &hashes, 0, &size);
+    for ( i = 0; i < count; i++ ) {
+        sprintf(loaded, "%s%s", staging, hashes[i]);
+        if ( access(loaded, F_OK) == 0 )
+            continue;
+        sprintf(path, "%s%s", STORE, hashes[i]);
+        pthread_mutex_lock(&store_lock);
+        if ( snapshot_pid > 0 && snapshot_running() )
+            preserve(hashes[i]);
+        unlink(path);
+        pthread_mutex_unlock(&store_lock);
+    }
+
+    if ( count >= 0 )
+        count = list_hashes(staging, &hashes, 0, &size);
+    for ( i = 0; i < count; i++ ) {
+        sprintf(loaded, "%s%s", staging, hashes[i]);
+        sprintf(path, "%s%s", STORE, hashes[i]);
+        pthread_mutex_lock(&store_lock);
+        if ( snapshot_pid > 0 && snapshot_running() )
+            preserve(hashes[i]);
+        if ( rename(loaded, path) < 0 )
+            result = -1;
+        pthread_mutex_unlock(&store_lock);
+    }
+
+    free(hashes);
+    return count < 0 ? -1 : result;
+}
+
+/**********************************************************************/
+
+void save_replica_state(unsigned long long seq) {
+    char path[BUFFER_SIZE];
+    char tmp[BUFFER_SIZE];
+    char buf[32];
+
+    sprintf(path, "%s%s", STORE, REPLICA_STATE);
+    sprintf(tmp, "%s%s.tmp", STORE, REPLICA_STATE);
+    sprintf(buf, "%llu\n", seq);
+    if ( write_temp_file(tmp, (unsigned char *)buf, strlen(buf)) == 0 )
+        rename(tmp, path);
+}
+
+unsigned long long load_replica_state() {
+    char path[BUFFER_SIZE];
+    unsigned long long seq = 0;
+    FILE * file;
+
+    sprintf(path, "%s%s", STORE, REPLICA_STATE);
+    file = fopen(path, "r");
+    if ( file ) {
+        if ( fscanf(file, "%llu", &seq) != 1 )
+            seq = 0;
+        fclose(file);
+    }
+    return seq;
+}
+
+/**********************************************************************/
+/* How far behind the primary a replica is: the age of the last applied
+ * change while records are outstanding, or the time since the primary
+ * was last heard from while disconnected.
+ * Returns: the lag in milliseconds */
+/**********************************************************************/
+unsigned long long replication_lag_ms() {
+    unsigned long long now = now_ms();
+    unsigned long long lag = 0;
+
+    pthread_mutex_lock(&replica_lock);
+    if ( !replica.connected )
+        lag = now - replica.last_contact;
+    else if ( replica.applied < replica.primary_seq && now > replica.applied_time )
+        lag = now - replica.applied_time;
+    pthread_mutex_unlock(&replica_lock);
+    return lag;
+}
+
+/**********************************************************************/
+/* Open a TCP connection to another server.
+ * Returns: the socket, or -1 on error */
+/**********************************************************************/
+int connect_to(const char * host, u_short port) {
+    struct addrinfo hints;
+    struct addrinfo * addrs;
+    struct addrinfo * a;
+    char service[8];
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(service, "%u", port);
+    if ( getaddrinfo(host, service, &hints, &addrs) != 0 )
+        return -1;
+    for ( a = addrs; a; a = a->ai_next ) {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if ( sock < 0 )
+            continue;
+        if ( connect(sock, a->ai_addr, a->ai_addrlen) == 0 )
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addrs);
+    return sock;
+}
+
+/**********************************************************************/
+/* Send a GET request to another server and read the response headers.
+ * Parameters: the server's host and port
+ *             the path to request
+ *             set to the response status code
+ * Returns: a socket positioned at the start of the body, or -1 */
+/**********************************************************************/
+int http_get(const char * host, u_short port, const char * path, int * status) {
+    char buf[BUFFER_SIZE];
+    struct timeval timeout;
+    int sock;
+
+    sock = connect_to(host, port);
+    if ( sock < 0 )
+        return -1;
+
+    /* a primary that stalls or drops off the network without closing
+     * the connection must not block the replica forever */
+    timeout.tv_sec = REPLICA_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sprintf(buf, "GET %s HTTP/1.0\r\n\r\n", path);
+    if ( write_all(sock, buf, strlen(buf)) < 0 ||
+         get_line(sock, buf, sizeof(buf)) < 12 ) {
+        close(sock);
+        return -1;
+    }
+    *status = atoi(buf + 9);
+    while ( get_line(sock, buf, sizeof(buf)) > 0 && strcmp("\n", buf) )
+        ;
+    return sock;
+}
+
+/**********************************************************************/
+
+unsigned long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**********************************************************************/
+/* Build the consistent hash ring over the backends given on the
+ * command line.  Each backend owns PROXY_VNODES points on the ring so
+ * adding or removing one only moves its share of the keys.
+ * Parameters: the "host:port" strings
+ *             how many there are */
+/**********************************************************************/
+void proxy_setup(char ** specs, int count) {
+    char name[BUFFER_SIZE];
+    char * colon;
+    int i, v;
+
+    backends = (struct backend *)calloc(count, sizeof(struct backend));
+    ring = (struct ring_point *)malloc(count * PROXY_VNODES * sizeof(struct ring_point));
+    if ( !backends || !ring )
+        error_die("proxy");
+    backend_count = count;
+    ring_size = count * PROXY_VNODES;
+
+    for ( i = 0; i < count; i++ ) {
+        colon = strchr(specs[i], ':');
+        if ( !colon ) {
+            fprintf(stderr, "proxy: backend %s is not host:port\n", specs[i]);
+            exit(1);
+        }
+        *colon = 0x00;
+        backends[i].host = specs[i];
+        backends[i].port = atoi(colon + 1);
+        pthread_mutex_init(&backends[i].lock, NULL);
+
+        for ( v = 0; v < PROXY_VNODES; v++ ) {
+            sprintf(name, "%s:%u-%d", backends[i].host, backends[i].port, v);
+            ring[i * PROXY_VNODES + v].point = hash_point(name);
+            ring[i * PROXY_VNODES + v].backend = i;
+        }
+    }
+    qsort(ring, ring_size, sizeof(struct ring_point), compare_ring_points);
+}
+
+/**********************************************************************/
+
+int compare_ring_points(const void * a, const void * b) {
+    unsigned int pa = ((const struct ring_point *)a)->point;
+    unsigned int pb = ((const struct ring_point *)b)->point;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/**********************************************************************/
+/* Position of a string on the ring: the first 32 bits of its md5, the
+ * same hash the backends use to place keys on disk. */
+/**********************************************************************/
+unsigned int hash_point(const char * text) {
+    char copy[BUFFER_SIZE];
+    char hash[33];
+
+    strncpy(copy, text, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = 0x00;
+    md5(copy, hash);
+    hash[8] = 0x00;
+    return strtoul(hash, NULL, 16);
+}
+
+/**********************************************************************/
+/* Returns: the index of the backend that owns a key */
+/**********************************************************************/
+int route_key(const char * key) {
+    unsigned int h = hash_point(key);
+    int low = 0, high = ring_size;
+    int mid;
+
+    /* first point at or after h, wrapping around the ring */
+    while ( low < high ) {
+        mid = (low + high) / 2;
+        if ( ring[mid].point < h )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return ring[low == ring_size ? 0 : low].backend;
+}
+
+/**********************************************************************/
+/* Take an idle keep-alive connection to a backend from its pool, or
+ * open a new one.  Connecting counts as backend time.
+ * Returns: the connection, or NULL if the backend is unreachable */
+/**********************************************************************/
+struct backend_conn * pool_get(struct backend * b) {
+    struct backend_conn * conn = NULL;
+    unsigned long long start;
+    int one = 1;
+
+    pthread_mutex_lock(&b->lock);
+    b->requests++;
+    if ( b->idle_count > 0 )
+        conn = b->idle[--b->idle_count];
+    pthread_mutex_unlock(&b->lock);
+    if ( conn ) {
+        conn->reused = 1;
+        return conn;
+    }
+
+    conn = (struct backend_conn *)malloc(sizeof(struct backend_conn));
+    if ( !conn )
+        return NULL;
+    start = now_ns();
+    conn->fd = connect_to(b->host, b->port);
+    backend_wait_ns += now_ns() - start;
+    if ( conn->fd < 0 ) {
+        free(conn);
+        return NULL;
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn->reused = 0;
+    conn->start = conn->end = 0;
+    return conn;
+}
+
+/**********************************************************************/
+/* Write a request to a backend, counting the time as backend time.
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int backend_write(struct backend_conn * conn, const char * buf, size_t len) {
+    unsigned long long start = now_ns();
+    int result;
+
+    result = write_all(conn->fd, buf, len);
+    backend_wait_ns += now_ns() - start;
+    return result;
+}
+
+/**********************************************************************/
+/* Return a connection whose last response was fully read to its pool. */
+/**********************************************************************/
+void pool_put(struct backend * b, struct backend_conn * conn) {
+    pthread_mutex_lock(&b->lock);
+    if ( b->idle_count < PROXY_POOL_SIZE && conn->start == conn->end ) {
+        b->idle[b->idle_count++] = conn;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&b->lock);
+    if ( conn )
+        pool_discard(conn);
+}
+
+void pool_discard(struct backend_conn * conn) {
+    close(conn->fd);
+    free(conn);
+}
+
+/**********************************************************************/
+/* Read more of a backend's response into the connection buffer.  Time
+ * spent blocked here is counted as backend time, not proxy overhead.
+ * Returns: the number of bytes read, 0 at end of stream, -1 on error */
+/**********************************************************************/
+long conn_fill(struct backend_conn * conn) {
+    unsigned long long start = now_ns();
+    ssize_t got;
+
+    if ( conn->start == conn->end )
+        conn->start = conn->end = 0;
+    do {
+        got = recv(conn->fd, conn->buf + conn->end, sizeof(conn->buf) - conn->end, 0);
+    } while ( got < 0 && errno == EINTR );
+    backend_wait_ns += now_ns() - start;
+    if ( got > 0 )
+        conn->end += got;
+    return got;
+}
+
+/**********************************************************************/
+/* Read one header line, including its line ending.
+ * Returns: the length of the line, or -1 if the stream ended first */
+/**********************************************************************/
+int conn_read_line(struct backend_conn * conn, char * line, int size) {
+    int i = 0;
+    char c;
+
+    while ( i < size - 1 ) {
+        if ( conn->start == conn->end && conn_fill(conn) <= 0 )
+            return -1;
+        c = conn->buf[conn->start++];
+        line[i++] = c;
+        if ( c == '\n' )
+            break;
+    }
+    line[i] = 0x00;
+    return i;
+}
+
+/**********************************************************************/
+/* Read up to len bytes of a response body.
+ * Returns: the number of bytes read, 0 at end of stream, -1 on error */
+/**********************************************************************/
+long conn_read(struct backend_conn * conn, char * buf, size_t len) {
+    long got;
+
+    if ( conn->start == conn->end && (got = conn_fill(conn)) <= 0 )
+        return got;
+    got = conn->end - conn->start;
+    if ( (size_t)got > len )
+        got = len;
+    memcpy(buf, conn->buf + conn->start, got);
+    conn->start += got;
+    return got;
+}
+
+/**********************************************************************/
+/* Read the status line and headers of a backend response.  Connection
+ * handling headers are dropped since the proxy answers for its own
+ * connection to the client.
+ * Returns: 0 on success, -1 if the connection failed */
+/**********************************************************************/
+int read_response_head(struct backend_conn * conn, struct backend_response * response) {
+    char line[BUFFER_SIZE];
+    int len, keep;
+
+    if ( conn_read_line(conn, line, sizeof(line)) < 12 )
+        return -1;
+    strcpy(response->status_line, line);
+    response->status = atoi(line + 9);
+    keep = strncmp(line, "HTTP/1.1", 8) == 0;
+    response->content_length = -1;
+    response->headers_len = 0;
+
+    while (1) {
+        len = conn_read_line(conn, line, sizeof(line));
+        if ( len < 0 )
+            return -1;
+        if ( strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0 )
+            break;
+        if ( strncasecmp(line, "Content-Length:", 15) == 0 ) {
+            response->content_length = atol(line + 15);
+        } else if ( strncasecmp(line, "Connection:", 11) == 0 ) {
+            if ( strcasestr(line + 11, "close") )
+                keep = 0;
+            else if ( strcasestr(line + 11, "keep-alive") )
+                keep = 1;
+        } else if ( strncasecmp(line, "Keep-Alive:", 11) != 0 &&
+                    response->headers_len + len < sizeof(response->headers) ) {
+            memcpy(response->headers + response->headers_len, line, len);
+            response->headers_len += len;
+        }
+    }
+    response->headers[response->headers_len] = 0x00;
+    /* a 304 never has a body, whatever its headers say */
+    if ( response->status == 304 )
+        response->content_length = 0;
+    response->keep_alive = keep && response->content_length >= 0;
+    return 0;
+}
+
+/**********************************************************************/
+/* Send a request to a backend and read the response head.  A pooled
+ * connection the backend has since closed is retried once on a fresh
+ * connection.
+ * Parameters: the backend
+ *             the connection to use, or NULL; set to the one used
+ *             whether the request was already written to *conn
+ *             the request
+ *             set to the response head
+ * Returns: 0 on success, -1 if the backend could not be reached */
+/**********************************************************************/
+int backend_exchange(struct backend * b, struct backend_conn ** conn, int sent,
+                     const char * request, size_t len,
+                     struct backend_response * response) {
+    int retry;
+
+    while (1) {
+        if ( !*conn ) {
+            *conn = pool_get(b);
+            sent = 0;
+        }
+        if ( !*conn )
+            return -1;
+        if ( (sent || backend_write(*conn, request, len) == 0) &&
+             read_response_head(*conn, response) == 0 )
+            return 0;
+
+        retry = (*conn)->reused;
+        pool_discard(*conn);
+        *conn = NULL;
+        if ( !retry )
+            return -1;
+    }
+}
+
+/**********************************************************************/
+/* Build a request for a backend, passing through the client's headers.
+ * Returns: the length of the request */
+/**********************************************************************/
+size_t backend_request(char * out, struct backend * b, const char * url,
+                       const char * headers) {
+    return sprintf(out, "GET %s HTTP/1.1\r\n"
+                        "Host: %s:%u\r\n"
+                        "%s"
+                        "\r\n", url, b->host, b->port, headers);
+}
+
+/**********************************************************************/
+/* A request has arrived on a client connection of a proxy.  Route it
+ * to the backend that owns its key.
+ * Parameters: the socket connected to the client
+ * Returns: non-zero if the connection should be kept open */
+/**********************************************************************/
+int proxy_request(int client) {
+    char buf[BUFFER_SIZE];
+    char url[BUFFER_SIZE];
+    char forwarded[BUFFER_SIZE];
+    size_t forwarded_len = 0;
+    char * key;
+    char saved = 0x00;
+    char * end = NULL;
+    unsigned long long start;
+    int numchars, http11, wants_close = 0, wants_keep_alive = 0;
+    long deadline_ms = 0, remaining_ms;
+    size_t i, j;
+
+    numchars = get_line(client, buf, sizeof(buf));
+    if ( numchars == 0 )
+        return 0;
+    start = now_ns();
+    backend_wait_ns = 0;
+
+    /* skip the method; only GET is served */
+    j = 0;
+    while (!ISspace(buf[j]) && (j < BUFFER_SIZE))
+        j++;
+    while (ISspace(buf[j]) && (j < BUFFER_SIZE))
+        j++;
+    i = 0;
+    while (!ISspace(buf[j]) && (i < BUFFER_SIZE - 1) && (j < BUFFER_SIZE)) {
+        url[i] = buf[j];
+        i++; j++;
+    }
+    url[i] = '\0';
+    while (ISspace(buf[j]) && (j < BUFFER_SIZE))
+        j++;
+    http11 = strncasecmp(buf + j, "HTTP/1.1", 8) == 0;
+
+    /* keep the client's headers to pass on, apart from those about
+     * its own connection */
+    forwarded[0] = 0x00;
+    while ((numchars > 0) && strcmp("\n", buf)) {
+        numchars = get_line(client, buf, BUFFER_SIZE);
+        if ( numchars <= 1 )
+            continue;
+        if ( strncasecmp(buf, "Connection:", 11) == 0 ) {
+            wants_close = strcasestr(buf + 11, "close") != NULL;
+            wants_keep_alive = strcasestr(buf + 11, "keep-alive") != NULL;
+        } else if ( strncasecmp(buf, "X-Deadline-Ms:", 14) == 0 ) {
+            deadline_ms = atol(buf + 14);
+        } else if ( strncasecmp(buf, "Host:", 5) != 0 &&
+                    strncasecmp(buf, "Keep-Alive:", 11) != 0 &&
+                    forwarded_len + numchars + 2 < sizeof(forwarded) ) {
+            /* get_line turns line endings into "\n" */
+            memcpy(forwarded + forwarded_len, buf, numchars - 1);
+            forwarded_len += numchars - 1;
+            memcpy(forwarded + forwarded_len, "\r\n", 3);
+            forwarded_len += 2;
+        }
+    }
+    if ( strcmp("\n", buf) && head_timed_out(client) )
+        return 0;
+    keep_alive = http11 ? !wants_close : wants_keep_alive;
+    TRACE_PHASE(PHASE_PARSE);
+    if ( TRACE )
+        trace_url(url);
+
+    if ( ( request_shed || request_expired(deadline_ms) ) &&
+         strcasecmp(url,"/stats") != 0 &&
+         strncasecmp(url,"/debug/",7) != 0 ) {
+        shed_request(client);
+        return keep_alive;
+    }
+
+    /* backends get what is left of the client's deadline */
+    if ( deadline_ms > 0 ) {
+        remaining_ms = deadline_ms - (long)((now_ns() - request_ready_ns) / 1000000);
+        if ( forwarded_len + 40 < sizeof(forwarded) )
+            forwarded_len += sprintf(forwarded + forwarded_len,
+                                     "X-Deadline-Ms: %ld\r\n",
+                                     remaining_ms > 1 ? remaining_ms : 1);
+    }
+
+    if ( strncasecmp(url,"/get/",5) == 0 ) {
+        key = url + 5;
+    } else if ( strncasecmp(url,"/set/",5) == 0 ) {
+        key = url + 5;
+        end = strchr(key, '?');
+    } else if ( strncasecmp(url,"/delete/",8) == 0 ) {
+        key = url + 8;
+    } else if ( strncasecmp(url,"/edit/",6) == 0 ) {
+        key = url + 6;
+    } else {
+        key = NULL;
+    }
+
+    if ( key ) {
+        if ( end ) {
+            saved = *end;
+            *end = 0x00;
+        }
+        i = route_key(key);
+        if ( end )
+            *end = saved;
+        proxy_forward(client, &backends[i], url, forwarded);
+    } else if ( strncasecmp(url,"/mget/",6) == 0 ) {
+        proxy_mget(client, url + 6, forwarded);
+    } else if ( strcasecmp(url,"/stats") == 0 ) {
+        keep_alive = 0;
+        proxy_stats(client);
+    } else if ( strncasecmp(url,"/debug/slowlog",14) == 0 ) {
+        keep_alive = 0;
+        slowlog(client, url+14);
+    } else {
+        not_found(client);
+    }
+
+    pthread_mutex_lock(&proxy_lock);
+    proxy_requests++;
+    if ( now_ns() - start > backend_wait_ns )
+        proxy_overhead_ns += now_ns() - start - backend_wait_ns;
+    pthread_mutex_unlock(&proxy_lock);
+
+    return keep_alive;
+}
+
+/**********************************************************************/
+/* Relay one request to a backend and its response to the client. */
+/**********************************************************************/
+void proxy_forward(int client, struct backend * b, const char * url,
+                   const char * headers) {
+    char buf[BUFFER_SIZE];
+    struct backend_conn * conn = NULL;
+    struct backend_response response;
+    long remaining, got;
+    size_t len;
+
+    len = backend_request(buf, b, url, headers);
+    if ( backend_exchange(b, &conn, 0, buf, len, &response) < 0 ) {
+        status_page(client, "502 Bad Gateway");
+        return;
+    }
+
+    /* a body without a length runs to the end of the stream, so the
+     * client's connection has to end with it */
+    if ( response.content_length < 0 )
+        keep_alive = 0;
+    send(client, response.status_line, strlen(response.status_line), 0);
+    send(client, response.headers, response.headers_len, 0);
+    connection_header(client);
+    if ( response.content_length >= 0 && response.status != 304 ) {
+        sprintf(buf, "Content-Length: %ld\r\n", response.content_length);
+        send(client, buf, strlen(buf), 0);
+    }
+    send(client, "\r\n", 2, 0);
+
+    remaining = response.content_length;
+    while ( remaining != 0 ) {
+        got = conn_read(conn, buf, remaining > 0 && remaining < BUFFER_SIZE ?
+                                   remaining : BUFFER_SIZE);
+        if ( got <= 0 )
+            break;
+        send(client, buf, got, 0);
+        if ( remaining > 0 )
+            remaining -= got;
+    }
+
+    if ( response.keep_alive && remaining == 0 )
+        pool_put(b, conn);
+    else
+        pool_discard(conn);
+}
+
+/**********************************************************************/
+/* Split a multi-key get by backend, send every backend its share at
+ * once and merge the answers back into the order the keys were asked
+ * for.  The response has the same format as mget().
+ * Parameters: the socket connected to the client
+ *             the query string, "?k=[key]&k=[key]..."
+ *             the client headers to pass on */
+/**********************************************************************/
+void proxy_mget(int client, char * query, const char * headers) {
+    char buf[BUFFER_SIZE];
+    char ** keys = NULL;
+    int * owner = NULL;
+    char ** entries = NULL;
+    size_t * entry_len = NULL;
+    struct mget_part * parts = NULL;
+    struct mget_part * part;
+    struct backend_response response;
+    char * key;
+    char * next;
+    char * p;
+    char * nl;
+    char * body = NULL;
+    size_t body_len = 0, len;
+    int count = 0, size = 0, i, k, failed = 0;
+    long got;
+
+    for ( key = strstr(query, "k="); key; key = next ) {
+        key += 2;
+        next = strstr(key, "&k=");
+        if ( next ) {
+            next[0] = 0x00;
+            next++;
+        }
+        if ( count == size ) {
+            size = size ? size * 2 : 16;
+            keys = (char **)realloc(keys, size * sizeof(char *));
+            if ( !keys ) {
+                unavailable(client);
+                return;
+            }
+        }
+        keys[count++] = key;
     }
-    url[i] = '\0';
 
-    /* read & discard headers */
-    while ((numchars > 0) && strcmp("\n", buf))  
-        numchars = get_line(client, buf, BUFFER_SIZE);
+    owner = (int *)malloc((count + 1) * sizeof(int));
+    entries = (char **)calloc(count + 1, sizeof(char *));
+    entry_len = (size_t *)calloc(count + 1, sizeof(size_t));
+    parts = (struct mget_part *)calloc(backend_count, sizeof(struct mget_part));
+    if ( !owner || !entries || !entry_len || !parts ) {
+        failed = 1;
+        count = 0;
+    }
 
-    if( strncasecmp(url,"/get/",5) == 0 ) {
-        get(client, url+5);
-    } else if ( strncasecmp(url,"/set/",5) == 0 ) {
-        value = strchr(url,'?');
-        if ( value != NULL ) {
-            value[0] = 0x00;
-            /* skip over the null and "v=" */
-            value+=3;
-            set(client, url+5, value);
-        } else {
-            not_found(client);
+    /* build each backend's share of the keys */
+    for ( i = 0; i < count && !failed; i++ ) {
+        owner[i] = route_key(keys[i]);
+        part = &parts[owner[i]];
+        len = strlen(keys[i]);
+        p = (char *)realloc(part->url, part->url_len + len + 16);
+        if ( !p ) {
+            failed = 1;
+            break;
         }
-    } else if ( strncasecmp(url,"/edit/",6) == 0 ) {
-        edit(client, url+6);
-    } else {
-        not_found(client);
+        part->url = p;
+        part->url_len += sprintf(part->url + part->url_len, "%s%s",
+                                 part->url_len ? "&k=" : "/mget/?k=", keys[i]);
     }
-    
-    close(client);
-}
 
-/**********************************************************************/
+    /* send them all before waiting on any answer */
+    for ( k = 0; k < backend_count && !failed; k++ ) {
+        if ( !parts[k].url )
+            continue;
+        len = backend_request(buf, &backends[k], parts[k].url, headers);
+        parts[k].conn = pool_get(&backends[k]);
+        parts[k].sent = parts[k].conn &&
+                        backend_write(parts[k].conn, buf, len) == 0;
+    }
 
-void get(int client, char * key) {
-    char buf[BUFFER_SIZE];
-    FILE * file;
-    char hash[33];
-    int num_read;
-    
-    md5(key,hash);
-    #ifdef ENABLE_LOGGING
-    sprintf(buf,"get value for %s (%s)\n",key,hash);
-    log(buf);
-    #endif
-    
-    buf[0] = 0x00;
-    strcat(buf, STORE);
-    strcat(buf, hash);
-    
-    file = fopen( buf, "r" );
-    if ( file ) {
-        headers(client);
-        while ( (num_read = fread(buf,1,BUFFER_SIZE,file)) ) {
-            send(client, buf, num_read, 0);
+    for ( k = 0; k < backend_count && !failed; k++ ) {
+        if ( !parts[k].url )
+            continue;
+        len = backend_request(buf, &backends[k], parts[k].url, headers);
+        if ( backend_exchange(&backends[k], &parts[k].conn, parts[k].sent,
+                              buf, len, &response) < 0 ||
+             response.status != 200 || response.content_length < 0 ) {
+            failed = 1;
+            break;
         }
-        fclose(file);
-    } else {
-        not_found(client);
+        parts[k].body = (char *)malloc(response.content_length + 1);
+        if ( !parts[k].body ) {
+            failed = 1;
+            break;
+        }
+        for ( len = 0; len < (size_t)response.content_length; len += got ) {
+            got = conn_read(parts[k].conn, parts[k].body + len,
+                            response.content_length - len);
+            if ( got <= 0 )
+                break;
+        }
+        if ( len < (size_t)response.content_length ) {
+            failed = 1;
+            break;
+        }
+        parts[k].body_len = len;
+        if ( response.keep_alive )
+            pool_put(&backends[k], parts[k].conn);
+        else
+            pool_discard(parts[k].conn);
+        parts[k].conn = NULL;
     }
-}   
 
-/**********************************************************************/
+    /* each backend answers its keys in the order they were sent, so
+     * walking the keys in order walks every body in order */
+    for ( i = 0; i < count && !failed; i++ ) {
+        part = &parts[owner[i]];
+        p = part->body + part->offset;
+        nl = (char *)memchr(p, '\n', part->body_len - part->offset);
+        if ( !nl ) {
+            failed = 1;
+            break;
+        }
+        len = nl + 1 - p;
+        if ( strncmp(p, "VALUE ", 6) == 0 ) {
+            *nl = 0x00;
+            len += atol(strrchr(p, ' ') + 1) + 2;
+            *nl = '\n';
+        }
+        if ( part->offset + len > part->body_len ) {
+            failed = 1;
+            break;
+        }
+        entries[i] = p;
+        entry_len[i] = len;
+        part->offset += len;
+        body_len += len;
+    }
 
-void set(int client, char * key, char * value) {
-    char buf[BUFFER_SIZE];
-    FILE * file;
-    char hash[33];
-    
-    md5(key,hash);
-    #ifdef ENABLE_LOGGING
-    sprintf(buf,"set %s (%s) to %s\n",key,hash,value);
-    log(buf);
-    #endif
-    
-    buf[0] = 0x00;
-    strcat(buf, STORE);
-    strcat(buf, hash);
-    
-    file = fopen( buf, "w" );
-    if ( file ) {
-        urldecode(value);
-        fputs (value,file);
-        fclose(file);
-        headers(client);
-        sprintf(buf, "set %s\n",key);
+    if ( !failed )
+        body = (char *)malloc(body_len + 1);
+    if ( body ) {
+        for ( i = 0, len = 0; i < count; i++ ) {
+            memcpy(body + len, entries[i], entry_len[i]);
+            len += entry_len[i];
+        }
+        strcpy(buf, "HTTP/1.1 200 OK\r\n");
         send(client, buf, strlen(buf), 0);
+        connection_header(client);
+        sprintf(buf, "Content-Type: text/plain\r\n"
+                     "Content-Length: %lu\r\n"
+                     "\r\n", (unsigned long)body_len);
+        send(client, buf, strlen(buf), 0);
+        send(client, body, body_len, 0);
+        free(body);
     } else {
-        #ifdef ENABLE_LOGGING
-        sprintf(buf, "not found: %s\n",buf);
-        log(buf);
-        #endif
-        not_found(client);
+        status_page(client, "502 Bad Gateway");
+    }
+
+    for ( k = 0; parts && k < backend_count; k++ ) {
+        if ( parts[k].conn )
+            pool_discard(parts[k].conn);
+        free(parts[k].url);
+        free(parts[k].body);
     }
+    free(parts);
+    free(entries);
+    free(entry_len);
+    free(owner);
+    free(keys);
 }
 
 /**********************************************************************/
-
-void edit(int client, char * key) {
+/* Report proxy traffic and its own share of the request latency. */
+/**********************************************************************/
+void proxy_stats(int client) {
     char buf[BUFFER_SIZE];
-    FILE * file;
-    char hash[33];
-    int num_read;
-    
-    md5(key,hash);
-    #ifdef ENABLE_LOGGING
-    sprintf(buf,"edit value for %s (%s)\n",key,hash);
-    log(buf);
-    #endif
-    
-    buf[0] = 0x00;
-    strcat(buf, STORE);
-    strcat(buf, hash);
-    
-    file = fopen( buf, "r" );
-    if ( file ) {
-        headers(client);
-        sprintf(buf, "<form action=\"/set/%s\">",key);
-        send(client, buf, strlen(buf), 0);
-        sprintf(buf, "<textarea name=\"v\" rows=\"30\" cols=\"80\">");
-        send(client, buf, strlen(buf), 0);
-        while ( (num_read = fread(buf,1,BUFFER_SIZE,file)) ) {
-            send(client, buf, num_read, 0);
-        }
-        fclose(file);
-        sprintf(buf, "</textarea>");
-        send(client, buf, strlen(buf), 0);
-        sprintf(buf, "<input type=\"submit\" value=\"save\">");
-        send(client, buf, strlen(buf), 0);
-        sprintf(buf, "</form>");
-        send(client, buf, strlen(buf), 0);
-    } else {
-        not_found(client);
+    int len, i;
+
+    len = sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                       "Connection: close\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "\r\n");
+    pthread_mutex_lock(&proxy_lock);
+    len += sprintf(buf + len, "role proxy\nproxy_requests %lu\n"
+                              "proxy_overhead_us_avg %.1f\n",
+                   proxy_requests, proxy_requests ?
+                   proxy_overhead_ns / 1000.0 / proxy_requests : 0.0);
+    pthread_mutex_unlock(&proxy_lock);
+    len += admission_report(buf + len);
+    for ( i = 0; i < backend_count && len < (int)BUFFER_SIZE - 128; i++ ) {
+        pthread_mutex_lock(&backends[i].lock);
+        len += sprintf(buf + len, "backend %s:%u requests %lu idle %d\n",
+                       backends[i].host, backends[i].port,
+                       backends[i].requests, backends[i].idle_count);
+        pthread_mutex_unlock(&backends[i].lock);
     }
-}   
+    send(client, buf, len, 0);
+}
+
+/**********************************************************************/
+
+unsigned long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 /**********************************************************************/
 
@@ -304,18 +4992,7 @@ void urldecode(char * text) {
  * Parameters: client socket */
 /**********************************************************************/
 void bad_request(int client) {
-    char buf[BUFFER_SIZE];
-
-    sprintf(buf, "HTTP/1.0 400 BAD REQUEST\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "<P>Your browser sent a bad request, ");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "such as a POST without a Content-Length.\r\n");
-    send(client, buf, sizeof(buf), 0);
+    status_page(client, "400 Bad Request");
 }
 
 /**********************************************************************/
@@ -347,10 +5024,10 @@ int get_line(int sock, char *buf, int size) {
     int n;
 
     while ((i < size - 1) && (c != '\n')) {
-        n = recv(sock, &c, 1, 0);
+        n = recv_head(sock, &c, 0);
         if (n > 0) {
             if (c == '\r') {
-                n = recv(sock, &c, 1, MSG_PEEK);
+                n = recv_head(sock, &c, MSG_PEEK);
                 if ((n > 0) && (c == '\n'))
                  recv(sock, &c, 1, 0);
                 else
@@ -367,6 +5044,34 @@ int get_line(int sock, char *buf, int size) {
     return(i);
 }
 
+/**********************************************************************/
+/* Receive one byte of a request head for get_line().  On a worker the
+ * wait is bounded by request_deadline_ns, however steadily the bytes
+ * arrive; elsewhere this is a plain recv().
+ * Returns: as recv(), or -1 once the deadline has passed */
+/**********************************************************************/
+int recv_head(int sock, char * c, int flags) {
+    struct pollfd pfd;
+    unsigned long long now;
+    int n;
+
+    if ( !request_deadline_ns )
+        return recv(sock, c, 1, flags);
+    while (1) {
+        n = recv(sock, c, 1, flags | MSG_DONTWAIT);
+        if ( n >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+            return n;
+        now = now_ns();
+        if ( now >= request_deadline_ns )
+            return -1;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if ( poll(&pfd, 1, (request_deadline_ns - now) / 1000000 + 1) == 0 )
+            return -1;
+    }
+}
+
 /**********************************************************************/
 /* Return the informational HTTP headers about a file. */
 /* Parameters: the socket to print the headers on
@@ -375,14 +5080,13 @@ int get_line(int sock, char *buf, int size) {
 void headers(int client) {
     char buf[BUFFER_SIZE];
 
-    strcpy(buf, "HTTP/1.0 200 OK\r\n");
+    strcpy(buf, "HTTP/1.1 200 OK\r\n");
     send(client, buf, strlen(buf), 0);
     #ifdef SERVER_STRING
     strcpy(buf, SERVER_STRING);
     send(client, buf, strlen(buf), 0);
     #endif
-    sprintf(buf, "Connection: close\r\n");
-    send(client, buf, strlen(buf), 0);
+    connection_header(client);
     sprintf(buf, "Content-Type: text/html\r\n");
     send(client, buf, strlen(buf), 0);
     strcpy(buf, "\r\n");
@@ -390,27 +5094,154 @@ void headers(int client) {
 }
 
 /**********************************************************************/
-/* Give a client a 404 not found status message. */
+/* Send a complete 200 response with a short text body. */
 /**********************************************************************/
-void not_found(int client) {
+void text_response(int client, const char * body) {
     char buf[BUFFER_SIZE];
 
-    sprintf(buf, "HTTP/1.0 404 NOT FOUND\r\n");
+    strcpy(buf, "HTTP/1.1 200 OK\r\n");
     send(client, buf, strlen(buf), 0);
     #ifdef SERVER_STRING
-    sprintf(buf, SERVER_STRING);
+    strcpy(buf, SERVER_STRING);
+    send(client, buf, strlen(buf), 0);
+    #endif
+    connection_header(client);
+    sprintf(buf, "Content-Type: text/html\r\n"
+                 "Content-Length: %lu\r\n"
+                 "\r\n", (unsigned long)strlen(body));
+    send(client, buf, strlen(buf), 0);
+    send(client, body, strlen(body), 0);
+}
+
+/**********************************************************************/
+/* Tell the client whether the connection stays open. */
+/**********************************************************************/
+void connection_header(int client) {
+    if ( keep_alive )
+        send(client, "Connection: keep-alive\r\n", 24, 0);
+    else
+        send(client, "Connection: close\r\n", 19, 0);
+}
+
+/**********************************************************************/
+/* Send the headers for a value body.
+ * Parameters: the socket to print the headers on
+ *             the value being sent
+ *             whether the stored encoding is sent as is */
+/**********************************************************************/
+void value_headers(int client, struct value_info * info, int encoded) {
+    char buf[BUFFER_SIZE];
+
+    strcpy(buf, "HTTP/1.1 200 OK\r\n");
+    send(client, buf, strlen(buf), 0);
+    #ifdef SERVER_STRING
+    strcpy(buf, SERVER_STRING);
     send(client, buf, strlen(buf), 0);
     #endif
+    connection_header(client);
     sprintf(buf, "Content-Type: text/html\r\n");
     send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
+    if ( encoded ) {
+        sprintf(buf, "Content-Encoding: lz4\r\n"
+                     "X-Decoded-Length: %u\r\n", info->raw_len);
+        send(client, buf, strlen(buf), 0);
+    }
+    sprintf(buf, "Content-Length: %u\r\n"
+                 "Vary: Accept-Encoding\r\n"
+                 "Accept-Ranges: bytes\r\n",
+            encoded ? info->stored_len : info->raw_len);
+    send(client, buf, strlen(buf), 0);
+    if ( info->has_etag ) {
+        sprintf(buf, "ETag: \"%016llx%s\"\r\n", info->etag, encoded ? "-lz4" : "");
+        send(client, buf, strlen(buf), 0);
+    }
+    if ( REPLICA_HOST ) {
+        sprintf(buf, "X-Replication-Lag: %llu\r\n", replication_lag_ms());
+        send(client, buf, strlen(buf), 0);
+    }
+    strcpy(buf, "\r\n");
+    send(client, buf, strlen(buf), 0);
+}
+
+/**********************************************************************/
+/* Headers for part of a value, always sent decoded. */
+/**********************************************************************/
+void partial_headers(int client, struct value_info * info,
+                     unsigned int first, unsigned int last) {
+    char buf[BUFFER_SIZE];
+
+    strcpy(buf, "HTTP/1.1 206 Partial Content\r\n");
+    send(client, buf, strlen(buf), 0);
+    #ifdef SERVER_STRING
+    strcpy(buf, SERVER_STRING);
     send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><TITLE>404: Not Found</TITLE>\r\n");
+    #endif
+    connection_header(client);
+    sprintf(buf, "Content-Type: text/html\r\n"
+                 "Content-Range: bytes %u-%u/%u\r\n"
+                 "Content-Length: %u\r\n",
+            first, last, info->raw_len, last - first + 1);
     send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><h1>404: Not Found</h1>\r\n");
+    if ( info->has_etag ) {
+        sprintf(buf, "ETag: \"%016llx\"\r\n", info->etag);
+        send(client, buf, strlen(buf), 0);
+    }
+    if ( REPLICA_HOST ) {
+        sprintf(buf, "X-Replication-Lag: %llu\r\n", replication_lag_ms());
+        send(client, buf, strlen(buf), 0);
+    }
+    strcpy(buf, "\r\n");
     send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
+}
+
+/**********************************************************************/
+/* Whether a full response to this request sends a value's stored lz4
+ * bytes as they are, which also decides the form of its ETag. */
+/**********************************************************************/
+int sends_lz4(struct value_info * info, struct request_headers * request) {
+    unsigned int first, last;
+
+    return info->codec != CODEC_RAW && request->accept_lz4 &&
+           ( !request->range[0] ||
+             parse_range(request->range, info->raw_len, &first, &last) == 0 );
+}
+
+/**********************************************************************/
+/* Tell the client its copy of a value is current.  There is no body.
+ * The ETag has the form the full response would have sent.
+ * Parameters: the socket connected to the client
+ *             the value
+ *             whether the full response sends the stored encoding */
+/**********************************************************************/
+void not_modified(int client, struct value_info * info, int encoded) {
+    char buf[BUFFER_SIZE];
+
+    strcpy(buf, "HTTP/1.1 304 Not Modified\r\n");
+    send(client, buf, strlen(buf), 0);
+    #ifdef SERVER_STRING
+    strcpy(buf, SERVER_STRING);
+    send(client, buf, strlen(buf), 0);
+    #endif
+    connection_header(client);
+    strcpy(buf, "Vary: Accept-Encoding\r\n");
     send(client, buf, strlen(buf), 0);
+    if ( info->has_etag ) {
+        sprintf(buf, "ETag: \"%016llx%s\"\r\n", info->etag, encoded ? "-lz4" : "");
+        send(client, buf, strlen(buf), 0);
+    }
+    if ( REPLICA_HOST ) {
+        sprintf(buf, "X-Replication-Lag: %llu\r\n", replication_lag_ms());
+        send(client, buf, strlen(buf), 0);
+    }
+    strcpy(buf, "\r\n");
+    send(client, buf, strlen(buf), 0);
+}
+
+/**********************************************************************/
+/* Give a client a 404 not found status message. */
+/**********************************************************************/
+void not_found(int client) {
+    status_page(client, "404 Not Found");
 }
 
 /**********************************************************************/
@@ -440,7 +5271,7 @@ int startup(u_short *port) {
             error_die("getsockname");
   *port = ntohs(name.sin_port);
     }
-    if (listen(httpd, 5) < 0)
+    if (listen(httpd, SOMAXCONN) < 0)
         error_die("listen");
     return(httpd);
 }
@@ -473,6 +5304,120 @@ void unimplemented(int client) {
     send(client, buf, strlen(buf), 0);
 }
 
+/**********************************************************************/
+/* Give a client a bare status page.
+ * Parameters: the client socket
+ *             the status code and reason, e.g. "503 Service Unavailable" */
+/**********************************************************************/
+void status_page(int client, const char * status) {
+    status_page_headers(client, status, "");
+}
+
+/* As status_page(), with extra header lines ending in "\r\n". */
+void status_page_headers(int client, const char * status, const char * extra) {
+    char buf[BUFFER_SIZE];
+    char body[BUFFER_SIZE];
+
+    sprintf(body, "<HTML><TITLE>%s</TITLE>\r\n"
+                  "<BODY><h1>%s</h1>\r\n"
+                  "</BODY></HTML>\r\n", status, status);
+
+    sprintf(buf, "HTTP/1.1 %s\r\n", status);
+    send(client, buf, strlen(buf), 0);
+    #ifdef SERVER_STRING
+    sprintf(buf, SERVER_STRING);
+    send(client, buf, strlen(buf), 0);
+    #endif
+    connection_header(client);
+    send(client, extra, strlen(extra), 0);
+    sprintf(buf, "Content-Type: text/html\r\n"
+                 "Content-Length: %lu\r\n"
+                 "\r\n", (unsigned long)strlen(body));
+    send(client, buf, strlen(buf), 0);
+    send(client, body, strlen(body), 0);
+}
+
+/* The server cannot handle the request right now. */
+void unavailable(int client) {
+    status_page(client, "503 Service Unavailable");
+}
+
+/* The server is shedding load; the client should back off briefly. */
+void overloaded(int client) {
+    status_page_headers(client, "503 Service Unavailable", "Retry-After: 1\r\n");
+}
+
+/* Writes are refused by replicas. */
+void forbidden(int client) {
+    status_page(client, "403 Forbidden");
+}
+
+/* The requested change log position is no longer available. */
+void gone(int client) {
+    status_page(client, "410 Gone");
+}
+
+/**********************************************************************/
+/* Report server and replication state as "name value" lines. */
+/**********************************************************************/
+void stats(int client) {
+    char buf[BUFFER_SIZE];
+    int len;
+
+    len = sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                       "Connection: close\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "\r\n");
+    len += sprintf(buf + len, "role %s\n",
+                   PRIMARY ? "primary" : REPLICA_HOST ? "replica" : "standalone");
+    len += admission_report(buf + len);
+    len += sprintf(buf + len, "startup_ms %.1f\n"
+                              "warmup_keys %lu\n"
+                              "warmup_done %lu\n"
+                              "warmup_bytes %lu\n"
+                              "warmup_ms %.1f\n",
+                   (listening_ns - process_start_ns) / 1000000.0,
+                   warmup.total, warmup.done, warmup.bytes,
+                   ((warmup.finished_ns ? warmup.finished_ns : now_ns()) -
+                    warmup.started_ns) / 1000000.0);
+    if ( log_fd >= 0 ) {
+        pthread_mutex_lock(&log_lock);
+        len += sprintf(buf + len, "log_base %llu\nlog_seq %llu\n",
+                       log_base, log_seq);
+        pthread_mutex_unlock(&log_lock);
+    }
+    if ( MEMTABLE ) {
+        pthread_mutex_lock(&memtable_lock);
+        len += sprintf(buf + len, "memtable_entries %lu\n"
+                                  "memtable_bytes %lu\n"
+                                  "memtable_writes %lu\n"
+                                  "memtable_coalesced %lu\n"
+                                  "memtable_flushes %lu\n"
+                                  "memtable_flushed %lu\n"
+                                  "memtable_stalls %lu\n"
+                                  "memtable_flush_errors %lu\n",
+                       memtable_active->count + memtable_flushing->count,
+                       (unsigned long)(memtable_active->bytes + memtable_flushing->bytes),
+                       memtable.writes, memtable.coalesced, memtable.flushes,
+                       memtable.flushed, memtable.stalls, memtable.flush_errors);
+        pthread_mutex_unlock(&memtable_lock);
+    }
+    if ( REPLICA_HOST ) {
+        pthread_mutex_lock(&replica_lock);
+        len += sprintf(buf + len, "replica_connected %d\n"
+                                  "replica_applied_seq %llu\n"
+                                  "replica_primary_seq %llu\n"
+                                  "replica_apply_errors %lu\n"
+                                  "replica_failing_seq %llu\n",
+                       replica.connected, replica.applied, replica.primary_seq,
+                       replica.apply_errors,
+                       replica.failures ? replica.failed_seq : 0ULL);
+        pthread_mutex_unlock(&replica_lock);
+        len += sprintf(buf + len, "replica_lag_ms %llu\n", replication_lag_ms());
+    }
+    send(client, buf, len, 0);
+}
+
 /**********************************************************************/
 
 #ifdef ENABLE_LOGGING
@@ -500,39 +5445,136 @@ int log(char * message) {
 
 int main(int argc, char *argv[]) {
     int server_sock = -1;
-    int client_sock = -1;
-    struct sockaddr_in client_name;
-    socklen_t client_name_len = sizeof(client_name);
+    char buf[BUFFER_SIZE];
+    pthread_t thread;
+    unsigned long long through;
+    int arg, i;
+
+    process_start_ns = now_ns();
+    if ( argc >= 2 && strcmp(argv[1], "--dump") == 0 ) {
+        STORE = argc == 3 ? argv[2] : DEFAULT_STORE;
+        sprintf(buf, "%s%s", STORE, LOG_NAME);
+        log_fd = open(buf, O_RDONLY);
+        if ( log_fd >= 0 )
+            log_scan(log_fd, &log_base, &log_seq, &log_end);
+        /* changes a memtable had not written yet are taken from the log
+         * without writing them, so a dump never changes the store */
+        memtable_active = (struct mem_table *)calloc(1, sizeof(struct mem_table));
+        if ( !memtable_active )
+            error_die("dump");
+        memtable_replay(memtable_active, log_seq, &through);
+        if ( dump_store(1, STORE, NULL, memtable_active, log_seq) < 0 )
+            error_die("dump");
+        exit(0);
+    } else if ( argc >= 2 && strcmp(argv[1], "--load") == 0 ) {
+        if ( load_store(0, argc == 3 ? argv[2] : DEFAULT_STORE, &log_seq) < 0 ) {
+            fprintf(stderr, "load: corrupt or truncated dump\n");
+            exit(1);
+        }
+        exit(0);
+    }
 
-    if ( argc < 2 ) {
-        printf("Usage: kvlite port [store]\n");
+    /* options come before the port */
+    for ( arg = 1; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++ ) {
+        if ( strcmp(argv[arg], "--no-compress") == 0 ) {
+            COMPRESS = 0;
+        } else if ( strcmp(argv[arg], "--memtable") == 0 && arg + 1 < argc ) {
+            MEMTABLE = 1;
+            MEMTABLE_MAX = (size_t)atol(argv[++arg]) * 1024 * 1024;
+        } else if ( strcmp(argv[arg], "--trace") == 0 ) {
+            TRACE = 1;
+        } else if ( strcmp(argv[arg], "--hot-sample") == 0 && arg + 1 < argc ) {
+            HOT_SAMPLE = atoi(argv[++arg]);
+        } else if ( strcmp(argv[arg], "--workers") == 0 && arg + 1 < argc ) {
+            WORKERS = atoi(argv[++arg]);
+        } else if ( strcmp(argv[arg], "--max-connections") == 0 && arg + 1 < argc ) {
+            MAX_CONNECTIONS = atoi(argv[++arg]);
+        } else if ( strcmp(argv[arg], "--proxy") == 0 ) {
+            PROXY = 1;
+        } else if ( strcmp(argv[arg], "--primary") == 0 ) {
+            PRIMARY = 1;
+        } else if ( strcmp(argv[arg], "--replica-of") == 0 && arg + 1 < argc &&
+                    strchr(argv[arg + 1], ':') ) {
+            REPLICA_HOST = argv[++arg];
+            REPLICA_PORT = atoi(strchr(REPLICA_HOST, ':') + 1);
+            *strchr(REPLICA_HOST, ':') = 0x00;
+        } else {
+            break;
+        }
+    }
+
+    if ( arg >= argc || strncmp(argv[arg], "--", 2) == 0 ||
+         ( PROXY && arg + 1 >= argc ) || WORKERS < 1 || MAX_CONNECTIONS < 1 ||
+         HOT_SAMPLE < 0 ||
+         ( MEMTABLE && ( MEMTABLE_MAX == 0 || REPLICA_HOST || PROXY ) ) ) {
+        printf("Usage: kvlite [options] port [store]\n");
+        printf("       kvlite --proxy port host:port [host:port ...]\n");
+        printf("       kvlite --dump [store] > dump\n");
+        printf("       kvlite --load [store] < dump\n");
+        printf("Options:\n");
+        printf("  --no-compress            store new values uncompressed\n");
+        printf("  --memtable mb            buffer up to mb of writes in memory\n");
+        printf("  --workers n              request threads (default 8)\n");
+        printf("  --trace                  record request phase timings\n");
+        printf("  --hot-sample n           profile one read in n for warm-up (default 16, 0 off)\n");
+        printf("  --max-connections n      connections served at once (default 1024)\n");
+        printf("  --primary                keep a change log for replicas\n");
+        printf("  --replica-of host:port   follow a primary's change log\n");
         printf("Example: kvlite 5461 /var/kvlitestore/ \n");
         exit(1);
+    } else if ( PROXY ) {
+        PORT = atoi(argv[arg]);
+        proxy_setup(argv + arg + 1, argc - arg - 1);
     } else {
-        PORT = atoi(argv[1]);
-        if ( argc == 3 ) {
-            STORE = argv[2];
+        PORT = atoi(argv[arg]);
+        if ( arg + 1 < argc ) {
+            STORE = argv[arg + 1];
         } else {
             STORE = DEFAULT_STORE;
         }
     }
     
+    if ( STORE ) {
+        sprintf(buf, "%s%s", STORE, SNAPSHOT_DIR);
+        clear_dir(buf);
+        sprintf(buf, "%s%s", STORE, RESYNC_DIR);
+        clear_dir(buf);
+    }
+
+    /* replicas and snapshot clients may go away mid stream */
+    signal(SIGPIPE, SIG_IGN);
+
+    for ( i = 0; i < KEY_LOCKS; i++ )
+        pthread_mutex_init(&key_locks[i], NULL);
+
+    if ( STORE && !REPLICA_HOST )
+        memtable_recover();
+    if ( ( PRIMARY || MEMTABLE ) && log_open() < 0 )
+        error_die("changelog");
+    if ( MEMTABLE )
+        memtable_setup();
+    if ( REPLICA_HOST ) {
+        replica.applied = load_replica_state();
+        replica.last_contact = now_ms();
+        if ( pthread_create(&thread, NULL, replicate, NULL) != 0 )
+            error_die("replicate");
+    }
+
+    if ( !PROXY && HOT_SAMPLE ) {
+        warmup_start();
+        if ( pthread_create(&thread, NULL, hot_profiler, NULL) != 0 )
+            error_die("hot profile");
+        pthread_detach(thread);
+    }
+
     server_sock = startup(&PORT);
+    listening_ns = now_ns();
     printf("kvlite running on port %d\n", PORT);
     #ifdef ENABLE_LOGGING
     log("kvlite started");
     #endif
     
-    while (1) {
-        client_sock = accept(server_sock,
-                                   (struct sockaddr *)&client_name,
-                                   &client_name_len);
-        if (client_sock == -1) error_die("accept");
-        #ifdef ENABLE_LOGGING
-        log("client connected");
-        #endif
-        accept_request(client_sock);
-    }
+    serve(server_sock);
 
     close(server_sock);
 
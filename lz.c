@@ -0,0 +1,225 @@
+/* Small LZ77 block codec.
+ * Produces and accepts the LZ4 block format (token, literals, 16 bit
+ * little endian offset, match length) so that blocks can be inspected
+ * with stock lz4 tooling.  Only the block format is implemented; there
+ * is no frame header or streaming state.
+ */
+
+#include "lz.h"
+
+#define LZ_MINMATCH     4
+#define LZ_LASTLITERALS 5
+#define LZ_MFLIMIT      12
+#define LZ_HASH_LOG     12
+#define LZ_MAX_OFFSET   65535
+
+/*
+**
+** lz_read32
+**
+** Unaligned 32 bit load used for hashing and match checks.
+**
+*/
+static unsigned int lz_read32( const unsigned char *p )
+{
+    unsigned int v;
+
+    memcpy( &v, p, 4 );
+    return( v );
+}
+
+static unsigned int lz_hash( unsigned int v )
+{
+    return( ( v * 2654435761U ) >> ( 32 - LZ_HASH_LOG ) );
+}
+
+/*
+**
+** lz_put_length
+**
+** Write the 255-run extension of a literal or match length.
+**
+*/
+static unsigned char *lz_put_length( unsigned char *op, int len )
+{
+    while( len >= 255 ) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char) len;
+    return( op );
+}
+
+/*
+**
+** lz_bound
+**
+** Worst case compressed size for an input of srclen bytes.
+**
+*/
+int lz_bound( int srclen )
+{
+    return( srclen + srclen / 255 + 16 );
+}
+
+/*
+**
+** lz_compress
+**
+** Greedy single pass compressor.  Returns the number of bytes written
+** to dst, or 0 if the output did not fit in dstcap bytes.
+**
+*/
+int lz_compress( const unsigned char *src, int srclen, unsigned char *dst, int dstcap )
+{
+    int table[ 1 << LZ_HASH_LOG ];
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *iend = src + srclen;
+    const unsigned char *mflimit = iend - LZ_MFLIMIT;
+    const unsigned char *matchlimit = iend - LZ_LASTLITERALS;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dstcap;
+    unsigned char *token;
+    int i, ref, litlen, len, offset;
+
+    for( i = 0; i < ( 1 << LZ_HASH_LOG ); i++ )
+        table[ i ] = -1;
+
+    if( srclen > LZ_MFLIMIT ) {
+        while( ip < mflimit ) {
+            unsigned int h = lz_hash( lz_read32( ip ) );
+            const unsigned char *match;
+
+            ref = table[ h ];
+            table[ h ] = (int)( ip - src );
+            if( ref < 0 || ip - ( src + ref ) > LZ_MAX_OFFSET ||
+                lz_read32( src + ref ) != lz_read32( ip ) ) {
+                ip++;
+                continue;
+            }
+            match = src + ref;
+
+            /* extend the match backwards into pending literals */
+            while( ip > anchor && match > src && ip[ -1 ] == match[ -1 ] ) {
+                ip--;
+                match--;
+            }
+            len = LZ_MINMATCH;
+            while( ip + len < matchlimit && ip[ len ] == match[ len ] )
+                len++;
+
+            litlen = (int)( ip - anchor );
+            if( op + 1 + litlen / 255 + 1 + litlen + 2 + len / 255 + 1 > oend )
+                return( 0 );
+
+            token = op++;
+            if( litlen >= 15 ) {
+                *token = 15 << 4;
+                op = lz_put_length( op, litlen - 15 );
+            } else {
+                *token = (unsigned char)( litlen << 4 );
+            }
+            memcpy( op, anchor, litlen );
+            op += litlen;
+
+            offset = (int)( ip - match );
+            *op++ = (unsigned char)( offset & 0xff );
+            *op++ = (unsigned char)( offset >> 8 );
+
+            if( len - LZ_MINMATCH >= 15 ) {
+                *token |= 15;
+                op = lz_put_length( op, len - LZ_MINMATCH - 15 );
+            } else {
+                *token |= (unsigned char)( len - LZ_MINMATCH );
+            }
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    /* the last sequence is literals only */
+    litlen = (int)( iend - anchor );
+    if( op + 1 + litlen / 255 + 1 + litlen > oend )
+        return( 0 );
+    token = op++;
+    if( litlen >= 15 ) {
+        *token = 15 << 4;
+        op = lz_put_length( op, litlen - 15 );
+    } else {
+        *token = (unsigned char)( litlen << 4 );
+    }
+    memcpy( op, anchor, litlen );
+    op += litlen;
+
+    return( (int)( op - dst ) );
+}
+
+/*
+**
+** lz_decompress
+**
+** Decode a block produced by lz_compress.  Returns the number of bytes
+** written to dst, or -1 if the input is malformed or does not fit.
+**
+*/
+int lz_decompress( const unsigned char *src, int srclen, unsigned char *dst, int dstcap )
+{
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + srclen;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dstcap;
+    const unsigned char *match;
+    unsigned char token, b;
+    int len, offset;
+
+    while( ip < iend ) {
+        token = *ip++;
+
+        len = token >> 4;
+        if( len == 15 ) {
+            do {
+                if( ip >= iend )
+                    return( -1 );
+                b = *ip++;
+                len += b;
+            } while( b == 255 );
+        }
+        if( len > iend - ip || len > oend - op )
+            return( -1 );
+        memcpy( op, ip, len );
+        op += len;
+        ip += len;
+
+        if( ip >= iend )
+            break;
+
+        if( iend - ip < 2 )
+            return( -1 );
+        offset = ip[ 0 ] | ( ip[ 1 ] << 8 );
+        ip += 2;
+        if( offset == 0 || offset > op - dst )
+            return( -1 );
+
+        len = token & 15;
+        if( len == 15 ) {
+            do {
+                if( ip >= iend )
+                    return( -1 );
+                b = *ip++;
+                len += b;
+            } while( b == 255 );
+        }
+        len += LZ_MINMATCH;
+        if( len > oend - op )
+            return( -1 );
+
+        /* byte copy so that overlapping matches repeat correctly */
+        match = op - offset;
+        while( len-- )
+            *op++ = *match++;
+    }
+
+    return( (int)( op - dst ) );
+}
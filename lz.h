@@ -0,0 +1,6 @@
+#include <stdio.h>
+#include <string.h>
+
+int lz_bound(int srclen);
+int lz_compress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap);
+int lz_decompress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap);
@@ -8,7 +8,7 @@
 /*
 ** typedefs for convenience
 */
-typedef unsigned long mULONG;
+typedef unsigned int mULONG;     /* must be exactly 32 bits */
 typedef unsigned char mUCHAR;
 
 